@@ -1,8 +1,17 @@
+#include <algorithm>
 #include <atomic>
+#include <new>
 #include <optional>
-#include <unordered_set>
+#include <thread>
 #include <utility>
 #include <vector>
+#ifdef __linux__
+#include <cerrno>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include "Constants.hpp"
 
@@ -10,91 +19,128 @@
 namespace Cutter {
 namespace Lockfree {
 
+/********* START TAGGED POINTER *********/
+
+static_assert(sizeof(void*) == sizeof(Tagged), "Tagged pointers assume a 64 bit address space.");
+
+template<typename P>
+inline P* untag(Tagged t) noexcept {
+    return reinterpret_cast<P*>(t & PTR_MASK);
+}
+
+// Produce the successor of old pointing at p.
+inline Tagged retag(void* p, Tagged old) noexcept {
+    return (((old >> TAG_SHIFT) + 1) << TAG_SHIFT) | reinterpret_cast<Tagged>(p);
+}
+
 /********* START HAZARD POINTER *********/
 
-HzdMemPool::HzdMemPool(void):
-    head_(std::atomic<Hzd*>(new Hzd())),
+inline HzdMemPool::HzdMemPool(void):
+    head_(std::atomic<Hzd*>(nullptr)),
+    free_(std::atomic<Tagged>(0)),
     len_(std::atomic<size_t>(0))
 {}
 
-HzdMemPool::~HzdMemPool(void) {
-    Hzd* cur = head_.load(); // FIXME: CHECK WHETHER THIS SHOULD START AT HEAD???
-    do {
+inline HzdMemPool::~HzdMemPool(void) {
+    Hzd* cur = head_.load();
+    while (cur != nullptr) {
         Hzd* next = cur->next();
         delete cur;
         cur = next;
-    } while (cur != nullptr);
+    }
 }
 
-Hzd* HzdMemPool::alloc(void) {
-    Hzd* p = head_.load();
-    bool False = false;
-    do {
-        if (p->active_.load() or !std::atomic_compare_exchange_strong(&p->active_, &False, true))
-            continue; 
-        return p; 
-    } while ((p = p->next()) != nullptr);
-
-    size_t old_len;
-    do {
-        old_len = len_.load(); 
-    } while (!std::atomic_compare_exchange_strong(&len_, &old_len, old_len + 1));
+// Take a record off the free list if there is one, otherwise make a new one.
+inline Hzd* HzdMemPool::alloc(void) {
+    Tagged old = free_.load();
+    Hzd* p;
+    while ((p = untag<Hzd>(old)) != nullptr) {
+        // Records are never freed, so reading free_next_ is safe even if p has been popped by someone else in
+        // the meantime.  The tag makes the CAS fail in that case.
+        if (std::atomic_compare_exchange_weak(&free_, &old, retag(p->free_next_.load(), old)))
+            return p;
+    }
 
-    p = new Hzd();
+    ++len_;
+    p = new Hzd(this);
     // Insert p at the head of the list
-    Hzd* old;
+    Hzd* head = head_.load();
     do {
-        old = head_.load();
-        p->next_ = old;
-    } while (!std::atomic_compare_exchange_strong(&head_, &old, p));
+        p->next_ = head;
+    } while (!std::atomic_compare_exchange_weak(&head_, &head, p));
 
     return p;
 }
 
-void HzdMemPool::free(Hzd* p) {
-    // This delete here is potentially problematic.
-    **p = nullptr;
-    p->active_ = false;
+inline void HzdMemPool::free(Hzd* p) {
+    if (p == nullptr)
+        return;
+    p->clear();
+    HzdMemPool* pool = p->pool_;
+    Tagged old = pool->free_.load();
+    do {
+        p->free_next_ = untag<Hzd>(old);
+    } while (!std::atomic_compare_exchange_weak(&pool->free_, &old, retag(p, old)));
 }
 
-Hzd* HzdMemPool::head(void) {
+inline Hzd* HzdMemPool::head(void) {
     return head_.load();
 }
 
-size_t HzdMemPool::length(void) {
+inline size_t HzdMemPool::length(void) {
     return len_.load();
 }
 
-Hzd::Hzd(void):
+inline Hzd::Hzd(HzdMemPool* pool):
     next_(std::atomic<Hzd *>(nullptr)),
-    ptr_(std::atomic<void *>(nullptr)),
-    active_(std::atomic<bool>(true))
-{}
-
+    free_next_(std::atomic<Hzd *>(nullptr)),
+    pool_(pool) {
+    for (auto& ptr : ptrs_) ptr.store(nullptr, std::memory_order_relaxed);
+}
 
 inline Hzd* Hzd::next(void) const {
     return next_.load();
 }
 
 inline std::atomic<void*>& Hzd::operator*(void) {
-    return ptr_;
+    return ptrs_[0];
+}
+
+inline std::atomic<void*>& Hzd::operator[](size_t i) {
+    return ptrs_[i];
 }
 
-ThreadLocalHzdWrapper::ThreadLocalHzdWrapper(Hzd*& p):
+inline void Hzd::clear(void) {
+    for (auto& ptr : ptrs_) ptr = nullptr;
+}
+
+inline void snapshotHazards(Hzd* head, std::vector<void*>& out) {
+    out.clear();
+    for (; head != nullptr; head = head->next()) {
+        for (size_t i = 0; i < HZD_SLOTS; ++i) {
+            void* p = (*head)[i];
+            if (p != nullptr)
+                out.push_back(p);
+        }
+    }
+    std::sort(out.begin(), out.end());
+}
+
+inline ThreadLocalHzdWrapper::ThreadLocalHzdWrapper(Hzd*& p):
     ptr(p)
 {}
 
-ThreadLocalHzdWrapper::ThreadLocalHzdWrapper(Hzd*&& p):
+inline ThreadLocalHzdWrapper::ThreadLocalHzdWrapper(Hzd*&& p):
     ptr(nullptr) {
     std::swap(p, ptr);
 }
 
-ThreadLocalHzdWrapper& ThreadLocalHzdWrapper::operator= (Hzd*& p) {
+inline ThreadLocalHzdWrapper& ThreadLocalHzdWrapper::operator= (Hzd*& p) {
     ptr = p;
     return *this;
 }
 
-ThreadLocalHzdWrapper& ThreadLocalHzdWrapper::operator= (Hzd*&& p) {
+inline ThreadLocalHzdWrapper& ThreadLocalHzdWrapper::operator= (Hzd*&& p) {
     std::swap(p, ptr);
     return *this;
 }
@@ -109,24 +155,460 @@ inline std::atomic<void*>& ThreadLocalHzdWrapper::operator*(void) {
     return **ptr;
 }
 
-ThreadLocalHzdWrapper::~ThreadLocalHzdWrapper(void) {
+inline std::atomic<void*>& ThreadLocalHzdWrapper::operator[](size_t i) {
+    return (*ptr)[i];
+}
+
+inline ThreadLocalHzdWrapper::~ThreadLocalHzdWrapper(void) {
     HzdMemPool::free(ptr); 
 }
 
+/********* START RECLAMATION *********/
+
+inline Orphanage::Orphanage(void):
+    any_(std::atomic<bool>(false))
+{}
+
+inline void Orphanage::give(std::vector<Retired>& retired) {
+    if (retired.empty())
+        return;
+    std::lock_guard<std::mutex> lock(mtx_);
+    orphans_.insert(orphans_.end(), retired.begin(), retired.end());
+    retired.clear();
+    any_ = true;
+}
+
+// Cheap enough to call on every scan: the lock is only taken when there's something to adopt.
+inline void Orphanage::adopt(std::vector<Retired>& retired) {
+    if (!any_.load(std::memory_order_relaxed))
+        return;
+    std::lock_guard<std::mutex> lock(mtx_);
+    retired.insert(retired.end(), orphans_.begin(), orphans_.end());
+    orphans_.clear();
+    any_ = false;
+}
+
+inline HzdMemPool& HazardPointers::Domain::pool(void) {
+    return pool_;
+}
+
+// This has to grow with the number of hazard pointers, or else a scan could free nothing and we'd rescan on
+// every retire.
+inline size_t HazardPointers::Domain::threshold(void) {
+    return std::max(
+        MIN_RLIST_SIZE,
+        static_cast<size_t>(Cutter::Const::RLIST_SCALE_FACTOR * pool_.length() * HZD_SLOTS)
+    );
+}
+
+inline HazardPointers::Domain& HazardPointers::domain(void) {
+    static Domain instance;
+    return instance;
+}
+
+inline HazardPointers::ThreadState::ThreadState(void):
+    hzd(domain().pool().alloc())
+{}
+
+// The hazard record goes back to the pool when hzd is destroyed, and whatever this thread retired is handed
+// over to the threads that remain.  Reclaiming here is not an option: the reclaim functions may depend on
+// other thread locals (the node caches, for instance) which could already be gone.
+inline HazardPointers::ThreadState::~ThreadState(void) {
+    domain().orphans_.give(rlist);
+}
+
+inline HazardPointers::ThreadState& HazardPointers::state(void) {
+    thread_local ThreadState ts;
+    return ts;
+}
+
+inline HazardPointers::Guard::Guard(void):
+    hzd_(state().hzd.operator->())
+{}
+
+// Publish the value of src in slot i, and retry until src is seen not to have changed in the meantime.  After
+// that, whoever unlinks the object is guaranteed to see the hazard when they scan.
+template<typename N>
+inline N* HazardPointers::Guard::protect(size_t i, const std::atomic<N*>& src) noexcept {
+    N* p = src.load();
+    while (true) {
+        (*hzd_)[i] = p;
+        N* again = src.load();
+        if (again == p)
+            return p;
+        p = again;
+    }
+}
+
+inline void HazardPointers::Guard::publish(size_t i, void* p) noexcept {
+    (*hzd_)[i] = p;
+}
+
+inline void HazardPointers::retire(void* p, void (*reclaim)(void*)) {
+    ThreadState& ts = state();
+    ts.rlist.push_back(Retired{p, reclaim, 0});
+    if (ts.rlist.size() >= domain().threshold()) 
+        scan(ts);
+}
+
+inline void HazardPointers::quiesce(void) {
+    ThreadState& ts = state();
+    ts.hzd->clear();
+    scan(ts);
+}
+
+inline void HazardPointers::scan(ThreadState& ts) {
+    domain().orphans_.adopt(ts.rlist);
+    // Take a sorted snapshot of all hazard pointers which are currently in use.  The buffer is kept around
+    // between scans, so after the first few this doesn't touch the allocator.
+    snapshotHazards(domain().pool().head(), ts.snapshot);
+    
+    // For each retired node, check whether it's an active hazard.  
+    // If it isn't, then reclaim it. If is it, then keep it around for the next scan.
+    auto keep = std::remove_if(ts.rlist.begin(), ts.rlist.end(), [&ts] (const Retired& r) {
+        if (std::binary_search(ts.snapshot.begin(), ts.snapshot.end(), r.ptr))
+            return false;
+        r.reclaim(r.ptr);
+        return true;
+    });
+    ts.rlist.erase(keep, ts.rlist.end());
+}
+
+inline EpochBased::Domain::Record::Record(void):
+    state(std::atomic<uint64_t>(0)),
+    active(std::atomic<bool>(true)),
+    next(nullptr)
+{}
+
+inline EpochBased::Domain::Domain(void):
+    epoch_(std::atomic<uint64_t>(0)),
+    records_(std::atomic<Record*>(nullptr))
+{}
+
+inline EpochBased::Domain::~Domain(void) {
+    Record* cur = records_.load();
+    while (cur != nullptr) {
+        Record* next = cur->next;
+        delete cur;
+        cur = next;
+    }
+}
+
+// Records are never freed while the domain is alive, so a thread reuses one that an exited thread gave up if
+// it can, and otherwise pushes a new one.
+inline EpochBased::Domain::Record* EpochBased::Domain::acquire(void) {
+    for (Record* r = records_.load(); r != nullptr; r = r->next) {
+        bool False = false;
+        if (!r->active.load() && r->active.compare_exchange_strong(False, true))
+            return r;
+    }
+    Record* r = new Record();
+    r->next = records_.load();
+    while (!records_.compare_exchange_weak(r->next, r)) continue;
+    return r;
+}
+
+inline void EpochBased::Domain::release(Record* r) {
+    r->state = 0;
+    r->active = false;
+}
+
+inline uint64_t EpochBased::Domain::epoch(void) const {
+    return epoch_.load();
+}
+
+// The epoch can move forward once every thread that is inside an operation has observed it.
+inline bool EpochBased::Domain::tryAdvance(void) {
+    uint64_t e = epoch_.load();
+    for (Record* r = records_.load(); r != nullptr; r = r->next) {
+        uint64_t s = r->state.load();
+        if ((s & 1) && (s >> 1) != e)
+            return false;
+    }
+    return epoch_.compare_exchange_strong(e, e + 1);
+}
+
+inline EpochBased::Domain& EpochBased::domain(void) {
+    static Domain instance;
+    return instance;
+}
+
+inline EpochBased::ThreadState::ThreadState(void):
+    record(domain().acquire()),
+    depth(0)
+{}
+
+// As for hazard pointers, leave the reclaiming to the threads that remain.
+inline EpochBased::ThreadState::~ThreadState(void) {
+    Domain::release(record);
+    domain().orphans_.give(limbo);
+}
+
+inline EpochBased::ThreadState& EpochBased::state(void) {
+    thread_local ThreadState ts;
+    return ts;
+}
+
+// Only the outermost guard announces the epoch.  The store has to be seq_cst so that it is ordered before any
+// of the loads made during the operation.
+inline EpochBased::Guard::Guard(void) {
+    ThreadState& ts = state();
+    if (ts.depth++ == 0)
+        ts.record->state.store((domain().epoch() << 1) | 1);
+}
+
+inline EpochBased::Guard::~Guard(void) {
+    ThreadState& ts = state();
+    if (--ts.depth == 0)
+        ts.record->state.store(0, std::memory_order_release);
+}
+
+// Nothing that is reachable when the epoch is announced can be freed before the guard goes away, so there is
+// nothing to publish.
+template<typename N>
+inline N* EpochBased::Guard::protect(size_t, const std::atomic<N*>& src) noexcept {
+    return src.load();
+}
+
+inline void EpochBased::Guard::publish(size_t, void*) noexcept {}
+
+inline void EpochBased::retire(void* p, void (*reclaim)(void*)) {
+    ThreadState& ts = state();
+    ts.limbo.push_back(Retired{p, reclaim, domain().epoch()});
+    if (ts.limbo.size() >= MIN_RLIST_SIZE)
+        collect(ts);
+}
+
+inline void EpochBased::quiesce(void) {
+    collect(state());
+}
+
+inline void EpochBased::collect(ThreadState& ts) {
+    domain().orphans_.adopt(ts.limbo);
+    domain().tryAdvance();
+    uint64_t e = domain().epoch();
+    auto keep = std::remove_if(ts.limbo.begin(), ts.limbo.end(), [e] (const Retired& r) {
+        if (r.epoch + 2 > e)
+            return false;
+        r.reclaim(r.ptr);
+        return true;
+    });
+    ts.limbo.erase(keep, ts.limbo.end());
+}
+
+/********* START EVENT COUNT *********/
+
+inline EventCount::EventCount(void):
+    key_(std::atomic<uint32_t>(0)),
+    waiters_(std::atomic<uint32_t>(0))
+{}
+
+inline uint32_t EventCount::prepareWait(void) noexcept {
+    // seq_cst so that the consumer's last look at the container can't be ordered ahead of announcing itself.
+    waiters_.fetch_add(1);
+    return key_.load();
+}
+
+inline void EventCount::cancelWait(void) noexcept {
+    waiters_.fetch_sub(1);
+}
+
+template<typename Rep, typename Period>
+void EventCount::wait(uint32_t key, const std::chrono::duration<Rep, Period>& timeout) noexcept {
+#ifdef __linux__
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32 bit word.");
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+    if (ns < 0) ns = 0;
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000);
+    // Returns straight away with EAGAIN if the key has already moved on.  That, EINTR and ETIMEDOUT all mean
+    // the same thing to the caller: go and look again.
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&key_), FUTEX_WAIT_PRIVATE, key, &ts, nullptr, 0);
+#else
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait_for(lock, timeout, [this, key] (void) { return key_.load() != key; });
+#endif
+    waiters_.fetch_sub(1);
+}
+
+inline void EventCount::wait(uint32_t key) noexcept {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&key_), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+#else
+    std::unique_lock<std::mutex> lock(mtx_);
+    cv_.wait(lock, [this, key] (void) { return key_.load() != key; });
+#endif
+    waiters_.fetch_sub(1);
+}
+
+// The fence pairs with the fetch_add in prepareWait: either the producer sees the waiter, or the waiter's
+// last look at the container sees what the producer just published.
+inline void EventCount::notify(void) noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) != 0)
+        wake(false);
+}
+
+inline void EventCount::notifyAll(void) noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) != 0)
+        wake(true);
+}
+
+inline void EventCount::wake(bool all) noexcept {
+#ifdef __linux__
+    key_.fetch_add(1);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&key_), FUTEX_WAKE_PRIVATE, all ? INT32_MAX : 1, nullptr, nullptr, 0);
+#else
+    {
+        // Bumping the key under the lock means a waiter can't check it and then miss the notify.
+        std::lock_guard<std::mutex> lock(mtx_);
+        key_.fetch_add(1);
+    }
+    if (all) cv_.notify_all();
+    else cv_.notify_one();
+#endif
+}
+
+/********* END EVENT COUNT *********/
+
+/********* START NODE POOL *********/
+
+inline void NodeSource::set(Allocate allocate) noexcept {
+    allocate_.store(allocate);
+}
+
+inline void* NodeSource::allocate(size_t bytes, size_t align) noexcept {
+    Allocate allocate = allocate_.load(std::memory_order_acquire);
+    return allocate != nullptr ? allocate(bytes, align) : nullptr;
+}
+
+template<typename N>
+thread_local typename NodePool<N>::Cache NodePool<N>::cache_;
+
+template<typename N>
+NodePool<N>::Cache::Cache(void):
+    head(nullptr),
+    count(0)
+{}
+
+// Hand whatever this thread still holds back to the depot so other threads can use it.
+template<typename N>
+NodePool<N>::Cache::~Cache(void) {
+    if (head != nullptr)
+        pushBatch(head, count);
+}
+
+template<typename N>
+constexpr NodePool<N>::Depot::Depot(void):
+    top(0),
+    blocks(nullptr)
+{}
+
+// Allocate a fresh block and return its slots chained together as a single batch.
+template<typename N>
+typename NodePool<N>::Link* NodePool<N>::grow(void) {
+    void* source = NodeSource::allocate((NODE_BATCH_SIZE + 1) * sizeof(Slot), alignof(Slot));
+    Slot* block = source != nullptr ? static_cast<Slot*>(source) : new Slot[NODE_BATCH_SIZE + 1];
+    // The first slot is reserved for linking the heap blocks together.  Blocks from the NodeSource belong to it.
+    if (source == nullptr) {
+        Header* header = new (block) Header{nullptr};
+        Slot* old = depot_.blocks.load();
+        do {
+            header->next = old;
+        } while (!std::atomic_compare_exchange_weak(&depot_.blocks, &old, block));
+    }
+
+    Link* head = nullptr;
+    for (size_t i = NODE_BATCH_SIZE; i > 0; --i) {
+        Link* link = new (&block[i]) Link;
+        link->next = head;
+        head = link;
+    }
+    head->count = NODE_BATCH_SIZE;
+    return head;
+}
+
+template<typename N>
+typename NodePool<N>::Link* NodePool<N>::popBatch(void) noexcept {
+    Tagged old = depot_.top.load();
+    Link* batch;
+    do {
+        batch = untag<Link>(old);
+        if (batch == nullptr)
+            return nullptr;
+        // If another thread pops this batch first, the slot may already be back in use and this read is garbage.
+        // That's harmless: the tag will have changed and the CAS below fails.  The word read is only ever written
+        // atomically (see Link), so it's garbage but not a data race.
+    } while (!std::atomic_compare_exchange_weak(&depot_.top, &old, retag(batch->next_batch.load(), old)));
+    return batch;
+}
+
+template<typename N>
+void NodePool<N>::pushBatch(Link* batch, size_t count) noexcept {
+    batch->count = count;
+    Tagged old = depot_.top.load();
+    do {
+        batch->next_batch = untag<Link>(old);
+    } while (!std::atomic_compare_exchange_weak(&depot_.top, &old, retag(batch, old)));
+}
+
+template<typename N>
+void* NodePool<N>::alloc(void) {
+    Cache& cache = cache_;
+    if (cache.head == nullptr) {
+        Link* batch = popBatch();
+        if (batch == nullptr) 
+            batch = grow();
+        cache.head = batch;
+        cache.count = batch->count;
+    }
+    Link* slot = cache.head;
+    cache.head = slot->next;
+    --cache.count;
+    return static_cast<void*>(slot);
+}
+
+template<typename N>
+void NodePool<N>::free(void* p) noexcept {
+    Cache& cache = cache_;
+    Link* link = new (p) Link;
+    link->next = cache.head;
+    cache.head = link;
+    if (++cache.count < 2 * NODE_BATCH_SIZE) 
+        return;
+
+    // The cache is full.  Keep the most recently freed half (it's the part most likely to still be hot) and
+    // send the rest to the depot.
+    Link* last = cache.head;
+    for (size_t i = 1; i < NODE_BATCH_SIZE; ++i) 
+        last = last->next;
+    Link* spill = last->next;
+    last->next = nullptr;
+    cache.count = NODE_BATCH_SIZE;
+    pushBatch(spill, NODE_BATCH_SIZE);
+}
+
 /********* START NODE  *********/
 
+// Sentinel: no value.
 template<typename T>
-Node<T>::Node(void):
-    value(T()),
-    next(std::atomic<Node<T>*>(nullptr))
-{}
+Node<T>::Node(void) {
+    next.store(nullptr, std::memory_order_relaxed);
+}
 
 template<typename T>
-template<typename S>
-Node<T>::Node(S&& val): 
-    value(std::forward<S>(val)),
-    next(std::atomic<Node<T>*>(nullptr))
-{}
+template<typename... Args>
+Node<T>::Node(std::in_place_t, Args&&... args): 
+    value(std::forward<Args>(args)...)
+{
+    next.store(nullptr, std::memory_order_relaxed);
+}
+
+// Whoever takes the value out of the node is responsible for destroying it.
+template<typename T>
+Node<T>::~Node(void) {}
 
 template<typename T>
 inline Node<T>& Node<T>::operator++ (void) {
@@ -164,59 +646,112 @@ inline T* Node<T>::operator-> (void) {
 
 /********* START QUEUE *********/
 
-   
-template<typename T>
-thread_local ThreadLocalHzdWrapper Queue<T>::hptr_a = mempool->alloc();
-
-template<typename T>
-thread_local ThreadLocalHzdWrapper Queue<T>::hptr_b = mempool->alloc();
+template<typename T, typename R>
+template<typename... S>
+inline Node<T>* Queue<T, R>::makeNode(S&&... value) {
+    return new (Pool::alloc()) Node<T>(std::forward<S>(value)...);
+}
 
-template<typename T>
-thread_local std::vector<Node<T>*> Queue<T>::rlist = std::vector<Node<T>*>();
+template<typename T, typename R>
+inline void Queue<T, R>::destroyNode(Node<T>* node) noexcept {
+    node->~Node<T>();
+    Pool::free(node);
+}
 
-template<typename T>
-size_t Queue<T>::MAX_RLIST_SIZE(void) { 
-    return static_cast<size_t>(Cutter::Const::RLIST_SCALE_FACTOR * mempool->length());
+// Retired nodes are always former sentinels, so there's no value to destroy.
+template<typename T, typename R>
+void Queue<T, R>::reclaim(void* node) {
+    destroyNode(static_cast<Node<T>*>(node));
 }
 
-template<typename T>
-Queue<T>::Queue(void):
-    head(std::atomic<Node<T>*>(new Node<T>())),
+template<typename T, typename R>
+Queue<T, R>::Queue(void):
+    Queue(nullptr)
+{}
+
+template<typename T, typename R>
+Queue<T, R>::Queue(EventCount* idle):
+    head(std::atomic<Node<T>*>(makeNode())),
+    dequeued_(std::atomic<size_t>(0)),
     tail(std::atomic<Node<T>*>(head.load())),
-    size_(std::atomic<size_t>(0))
+    enqueued_(std::atomic<size_t>(0)),
+    idle_(idle != nullptr ? idle : &own_)
 {}
 
 // Destructor: Traverse the list and remove any remaining nodes
-template<typename T>
-Queue<T>::~Queue(void) {
-    Node<T>* cur = head.load(); // FIXME: CHECK WHETHER THIS SHOULD START AT HEAD???
-    do {
-        Node<T>* next = cur->next.load();
-        delete cur;
-        cur = next;
-    } while (cur != nullptr);
+template<typename T, typename R>
+Queue<T, R>::~Queue(void) {
+    Node<T>* cur = head.load();
+    Node<T>* next = cur->next.load();
+    // The sentinel holds no value; everything after it does.
+    destroyNode(cur);
+    while ((cur = next) != nullptr) {
+        next = cur->next.load();
+        cur->value.~T();
+        destroyNode(cur);
+    }
 }
 
-template<typename T>
-inline bool Queue<T>::empty(void) const noexcept {
-    // Check whether the head and tail ptrs both point to the same dummy node
-    return size_.load() == 0;
+template<typename T, typename R>
+inline bool Queue<T, R>::empty(void) const noexcept {
+    typename R::Guard guard;
+    Node<T>* front = guard.protect(0, head);
+    bool empty = front->next.load() == nullptr;
+    // Guards don't clear their slots when they go, and callers poll this while idle, so don't leave front pinned
+    // until the thread's next operation.
+    guard.publish(0, nullptr);
+    return empty;
 }
 
 // FIXME: SFINAE to enforce that types T and S are related by declval
-template<typename T> 
+template<typename T, typename R> 
 template<typename S>
-void Queue<T>::enqueue(S&& value) noexcept {
-    // This gets deleted in dequeue.  The only thread owning value should be the one performing
-    // the enqueue, so there should not be issues with memory access here.
-    auto node = new Node<T>(std::forward<S>(value));  
-    
+void Queue<T, R>::enqueue(S&& value) noexcept {
+    // This gets recycled once it has been dequeued and no thread can still reach it.  The only thread owning
+    // value should be the one performing the enqueue, so there should not be issues with memory access here.
+    Node<T>* node = makeNode(std::in_place, std::forward<S>(value));
+    link(node, node);
+    enqueued_.fetch_add(1, std::memory_order_relaxed);
+    idle_->notify();
+}
+
+template<typename T, typename R>
+template<typename... Args>
+void Queue<T, R>::emplace(Args&&... args) noexcept {
+    Node<T>* node = makeNode(std::in_place, std::forward<Args>(args)...);
+    link(node, node);
+    enqueued_.fetch_add(1, std::memory_order_relaxed);
+    idle_->notify();
+}
+
+template<typename T, typename R>
+template<typename InputIt>
+size_t Queue<T, R>::enqueue_bulk(InputIt first, InputIt last) noexcept {
+    if (first == last) 
+        return 0;
+    // Nobody else can see these nodes until the chain is spliced in, so there's no need for atomics here.
+    Node<T>* chain_head = makeNode(std::in_place, *first);
+    Node<T>* chain_tail = chain_head;
+    size_t n = 1;
+    for (++first; first != last; ++first, ++n) {
+        Node<T>* node = makeNode(std::in_place, *first);
+        chain_tail->next.store(node, std::memory_order_relaxed);
+        chain_tail = node;
+    }
+    link(chain_head, chain_tail);
+    enqueued_.fetch_add(n, std::memory_order_relaxed);
+    idle_->notifyAll();
+    return n;
+}
+
+// Append the chain first -> ... -> last to the queue.  For a single node, first == last.  Until tail is swung
+// all the way to last, other producers will help it along one node at a time.
+template<typename T, typename R>
+void Queue<T, R>::link(Node<T>* first, Node<T>* last) noexcept {
+    typename R::Guard guard;
     Node<T>* next, *back;
     while(true) {
-        back = tail.load();
-        *hptr_a = back;
-        if (tail.load() != back) 
-            continue;
+        back = guard.protect(0, tail);
         // BEGIN HAZARDOUS SECTION // 
         next = back->next.load();
         if (back != tail.load()) 
@@ -225,129 +760,580 @@ void Queue<T>::enqueue(S&& value) noexcept {
             std::atomic_compare_exchange_weak(&tail, &back, next);
             continue;
         }
-        if (std::atomic_compare_exchange_weak(&back->next, &next, node))
+        if (std::atomic_compare_exchange_weak(&back->next, &next, first))
             break;
     }
-    std::atomic_compare_exchange_strong(&tail, &back, node);
+    std::atomic_compare_exchange_strong(&tail, &back, last);
     // END HAZARDOUS SECTION // 
-    ++size_;
     return;
 }
 
-template<typename T>
-std::optional<T> Queue<T>::dequeue(void) noexcept {
-    T out;
+template<typename T, typename R>
+std::optional<T> Queue<T, R>::dequeue(void) noexcept {
+    typename R::Guard guard;
     Node<T>* next, *front, *back;
     while(true) {
-        front = head.load();
+        front = guard.protect(0, head);
         // BEGIN HAZARDOUS SECTION //
-        *hptr_a = front;
-        if (front != head.load()) continue;
         back = tail.load();
         next = front->next.load();
-        *hptr_b = next;
+        guard.publish(1, next);
         if (front != head.load()) continue;
         if (next == nullptr) return {}; // Queue is empty
         if (front == back) {
             std::atomic_compare_exchange_weak(&tail, &back, next);
             continue;
         }
-        
-        out = next->value;   // TODO: Figure out how to convert this back to move semantics without segfaulting
         if (std::atomic_compare_exchange_weak(&head, &front, next)) {
             break;
         }
     }
+    // Only the consumer that wins the CAS may touch next->value, so it is safe to move it out now (reading it
+    // before the CAS, as this used to, races with the winner moving it out from under us).  next is the new
+    // sentinel and other consumers may dequeue past it at any moment, but the guard keeps it from being recycled.
+    std::optional<T> out(std::move(next->value));
+    next->value.~T();
     // END HAZARDOUS SECTION //
-    Queue<T>::retire(front); // TODO: Look into whether a custom allocator might be useful here so that we can re-use objects
-    --size_;
+    R::retire(front, reclaim);
+    dequeued_.fetch_add(1, std::memory_order_relaxed);
     return out;
 }
 
-template<typename T>
-size_t Queue<T>::size(void) const {
-    return size_.load();
+template<typename T, typename R>
+template<typename Rep, typename Period>
+std::optional<T> Queue<T, R>::dequeue_wait(const std::chrono::duration<Rep, Period>& timeout) noexcept {
+    std::optional<T> out = dequeue();
+    if (out) return out;
+    uint32_t key = idle_->prepareWait();
+    // Something may have been enqueued between the dequeue above and announcing ourselves, and its producer
+    // wouldn't have seen us.  Look once more before going to sleep.
+    out = dequeue();
+    if (out) {
+        idle_->cancelWait();
+        return out;
+    }
+    idle_->wait(key, timeout);
+    return dequeue();
 }
 
-template<typename T>
-typename Queue<T>::iterator Queue<T>::begin(void) noexcept {
+template<typename T, typename R>
+void Queue<T, R>::wake_all(void) noexcept {
+    idle_->notifyAll();
+}
+
+template<typename T, typename R>
+template<typename OutputIt>
+size_t Queue<T, R>::dequeue_bulk(OutputIt out, size_t max) noexcept {
+    if (max == 0) 
+        return 0;
+    typename R::Guard guard;
+    Node<T>* front, *back, *last, *next;
+    size_t n;
+    while (true) {
+        front = guard.protect(0, head);
+        // BEGIN HAZARDOUS SECTION //
+        back = tail.load();
+        // Walk up to max nodes past the sentinel.  None of them can be recycled for as long as head still points
+        // at front (front itself is protected, so head can't have left and come back), so it is enough to
+        // re-check head after each step instead of protecting every node.
+        last = front;
+        n = 0;
+        bool tail_lagging = false;
+        while (n < max) {
+            next = last->next.load();
+            if (front != head.load() || next == nullptr) 
+                break;
+            if (last == back) {
+                // Tail points into the range we want to claim.  Help it along before taking the range.
+                tail_lagging = true;
+                break;
+            }
+            last = next;
+            ++n;
+        }
+        if (front != head.load()) continue;
+        if (tail_lagging) {
+            std::atomic_compare_exchange_weak(&tail, &back, next);
+            continue;
+        }
+        if (n == 0) return 0; // Queue is empty
+        guard.publish(1, last);
+        if (std::atomic_compare_exchange_weak(&head, &front, last)) {
+            break;
+        }
+    }
+    // Everything between front and last now belongs to this thread.  last is the new sentinel and is kept
+    // alive by the guard, exactly as in dequeue().
+    Node<T>* cur = front;
+    for (size_t i = 0; i < n; ++i) {
+        next = cur->next.load();
+        *out = std::move(next->value);
+        ++out;
+        next->value.~T();
+        R::retire(cur, reclaim);
+        cur = next;
+    }
+    // END HAZARDOUS SECTION //
+    dequeued_.fetch_add(n, std::memory_order_relaxed);
+    return n;
+}
+
+// A consumer can count an element before its producer has, so the difference can briefly go negative.
+template<typename T, typename R>
+size_t Queue<T, R>::size(void) const {
+    size_t out = dequeued_.load(std::memory_order_relaxed);
+    size_t in = enqueued_.load(std::memory_order_relaxed);
+    return in > out ? in - out : 0;
+}
+
+template<typename T, typename R>
+typename Queue<T, R>::iterator Queue<T, R>::begin(void) noexcept {
     // Skip the sentinel
     return head.load()->next.load();
 }
 
 // FIXME: This needs to be made to agree with STL convention that the end() is 1 element past the last "real" element
-template<typename T>
-typename Queue<T>::iterator Queue<T>::end(void) noexcept {
+template<typename T, typename R>
+typename Queue<T, R>::iterator Queue<T, R>::end(void) noexcept {
     return tail.load();
 }
 
+/********* START STACK *********/
+
+template<typename T>
+Stack<T>::Stack(void):
+    top_(std::atomic<Tagged>(0)),
+    padding{0}
+{}
+
+template<typename T>
+Stack<T>::~Stack(void) {
+    Node<T>* cur = untag<Node<T>>(top_.load());
+    while (cur != nullptr) {
+        Node<T>* next = cur->next.load();
+        cur->value.~T();
+        cur->~Node<T>();
+        Pool::free(cur);
+        cur = next;
+    }
+}
+
 template<typename T>
-void Queue<T>::scan(Hzd* head) {
-    // Make a set out of all hazard pointers which are currently in use.
-    std::unordered_set<void *> active_hazards;
-    void* p;
+bool Stack<T>::empty(void) const noexcept {
+    return untag<Node<T>>(top_.load()) == nullptr;
+}
+
+// Put the chain first -> ... -> last on top of the stack.
+template<typename T>
+void Stack<T>::link(Node<T>* first, Node<T>* last) noexcept {
+    Tagged old = top_.load();
     do {
-        if ((p = **head) != nullptr)
-            active_hazards.insert(p);
-    } while ((head = head->next()) != nullptr);
-    
-    // For each retired node, check whether it's an active hazard.  
-    // If it isn't, then free the node. If is it, then check the next.
-    auto it = rlist.begin();
-    while (it != rlist.end()) {
-        if (active_hazards.find(static_cast<void*>(*it)) == active_hazards.end()) {
-            delete *it;
-            if (&*it != &rlist.back()) {
-                *it = rlist.back();
-            }
-            rlist.pop_back();
-        }
-        else {
-            ++it;
-        }
+        last->next.store(untag<Node<T>>(old), std::memory_order_relaxed);
+    } while (!std::atomic_compare_exchange_weak(&top_, &old, retag(first, old)));
+}
+
+template<typename T>
+template<typename S>
+void Stack<T>::push(S&& value) noexcept {
+    Node<T>* node = new (Pool::alloc()) Node<T>(std::in_place, std::forward<S>(value));
+    link(node, node);
+}
+
+template<typename T>
+template<typename... Args>
+void Stack<T>::emplace(Args&&... args) noexcept {
+    Node<T>* node = new (Pool::alloc()) Node<T>(std::in_place, std::forward<Args>(args)...);
+    link(node, node);
+}
+
+template<typename T>
+std::optional<T> Stack<T>::pop(void) noexcept {
+    Tagged old = top_.load();
+    Node<T>* top;
+    do {
+        if ((top = untag<Node<T>>(old)) == nullptr)
+            return {};
+        // If top has been popped by someone else since we loaded it, this reads whatever happens to be in the
+        // slot now.  The tag will have moved on, so the CAS fails and we never use it.
+    } while (!std::atomic_compare_exchange_weak(&top_, &old, retag(top->next.load(), old)));
+
+    std::optional<T> out(std::move(top->value));
+    top->value.~T();
+    top->~Node<T>();
+    Pool::free(top);
+    return out;
+}
+
+template<typename T>
+template<typename InputIt>
+size_t Stack<T>::push_bulk(InputIt first, InputIt last) noexcept {
+    if (first == last)
+        return 0;
+    // Build the chain top down, so it's private until the final CAS.
+    Node<T>* bottom = new (Pool::alloc()) Node<T>(std::in_place, *first);
+    Node<T>* top = bottom;
+    size_t n = 1;
+    for (++first; first != last; ++first, ++n) {
+        Node<T>* node = new (Pool::alloc()) Node<T>(std::in_place, *first);
+        node->next.store(top, std::memory_order_relaxed);
+        top = node;
     }
+    link(top, bottom);
+    return n;
 }
 
 template<typename T>
-void Queue<T>::retire(Node<T>* node) {
-    rlist.push_back(node);
-    if (rlist.size() >= MAX_RLIST_SIZE()) {
-        Queue<T>::scan(mempool->head());
+template<typename OutputIt>
+size_t Stack<T>::pop_bulk(OutputIt out, size_t max) noexcept {
+    if (max == 0)
+        return 0;
+    Tagged old;
+    Node<T>* top, *rest;
+    size_t n;
+    while (true) {
+        old = top_.load();
+        if ((top = untag<Node<T>>(old)) == nullptr)
+            return 0;
+        // Walk down up to max nodes.  As long as top_ still holds the same tagged value nothing has been pushed
+        // or popped, so the links we've read are the real ones.  Checking after every step keeps us from
+        // following garbage out of a recycled slot.
+        rest = top;
+        n = 0;
+        while (n < max && rest != nullptr && top_.load() == old) {
+            rest = rest->next.load();
+            ++n;
+        }
+        if (n < max && rest != nullptr)
+            continue;
+        if (std::atomic_compare_exchange_weak(&top_, &old, retag(rest, old)))
+            break;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        Node<T>* next = top->next.load();
+        *out = std::move(top->value);
+        ++out;
+        top->value.~T();
+        top->~Node<T>();
+        Pool::free(top);
+        top = next;
     }
+    return n;
+}
+
+/********* START RING BUFFER *********/
+
+// Slot i starts out free for the producer holding ticket i.
+template<typename T, size_t MAX_SIZE>
+RingBuffer<T, MAX_SIZE>::RingBuffer(void):
+    eq_ticker_(std::atomic<Index>(0)),
+    dq_ticker_(std::atomic<Index>(0)) {
+    for (Index i = 0; i < MAX_SIZE; ++i) 
+        buff[i].seq.store(i, std::memory_order_relaxed);
 }
 
-/*
-//
-// BEGIN RINGBUFER
-//
 template<typename T, size_t MAX_SIZE>
-RingBuffer<T, MAX_SIZE>::RingBuffer(void) {
-    memset(static_cast<void*>(buff), 0, MAX_SIZE * sizeof(T));
+RingBuffer<T, MAX_SIZE>::~RingBuffer(void) {
+    while (try_dequeue().has_value()) continue;
 }
 
 // To turn % into a bitwise operator, we must have MAX_SIZE being a power of two
 template<typename T, size_t MAX_SIZE>
-inline RingBuffer<T, MAX_SIZE>::idx(Index i) noexcept {
+inline typename RingBuffer<T, MAX_SIZE>::Index RingBuffer<T, MAX_SIZE>::idx(Index i) noexcept {
     return i & (MAX_SIZE - 1);
 }
 
 template<typename T, size_t MAX_SIZE>
 template<typename S>
-inline void RingBuffer<T, MAX_SIZE>::enqueue(S&& item) noexcept {
-    Index ticket = eq_ticker_.fetch_add(1);
-    buff[idx(ticket)] = std::forward<S>(item);
+bool RingBuffer<T, MAX_SIZE>::try_enqueue(S&& item) noexcept(std::is_nothrow_constructible<T, S&&>::value) {
+    // Once a ticket is claimed the slot has to be filled, or consumers would wait on it forever, so anything that
+    // might throw (a copy included) is built first, and only moved in once the ticket is ours.
+    if constexpr (!std::is_nothrow_constructible<T, S&&>::value) {
+        static_assert(
+            std::is_nothrow_move_constructible<T>::value, 
+            "RingBuffer elements that can throw while being built must be nothrow movable."
+        );
+        T value(std::forward<S>(item));
+        return try_enqueue(std::move(value));
+    }
+    Index ticket = eq_ticker_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &buff[idx(ticket)];
+        Index seq = cell->seq.load(std::memory_order_acquire);
+        int64_t lag = static_cast<int64_t>(seq - ticket);
+        if (lag == 0) {
+            // The slot is free for this lap.  Try to claim the ticket.
+            if (eq_ticker_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (lag < 0) {
+            // The slot still holds the element from the previous lap.
+            return false;
+        }
+        else {
+            // Another producer claimed this ticket first.
+            ticket = eq_ticker_.load(std::memory_order_relaxed);
+        }
+    }
+    new (cell->storage) T(std::forward<S>(item));
+    cell->seq.store(ticket + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, size_t MAX_SIZE>
+std::optional<T> RingBuffer<T, MAX_SIZE>::try_dequeue(void) noexcept {
+    Index ticket = dq_ticker_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &buff[idx(ticket)];
+        Index seq = cell->seq.load(std::memory_order_acquire);
+        int64_t lag = static_cast<int64_t>(seq - (ticket + 1));
+        if (lag == 0) {
+            if (dq_ticker_.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (lag < 0) {
+            // Nothing has been written to this slot for this lap yet.
+            return {};
+        }
+        else {
+            ticket = dq_ticker_.load(std::memory_order_relaxed);
+        }
+    }
+    T* elt = std::launder(reinterpret_cast<T*>(cell->storage));
+    std::optional<T> out(std::move(*elt));
+    elt->~T();
+    // Free the slot for the producer one lap ahead of us.
+    cell->seq.store(ticket + MAX_SIZE, std::memory_order_release);
+    return out;
+}
+
+template<typename T, size_t MAX_SIZE>
+template<typename S>
+inline void RingBuffer<T, MAX_SIZE>::enqueue(S&& item) noexcept(std::is_nothrow_constructible<T, S&&>::value) {
+    while (!try_enqueue(std::forward<S>(item))) 
+        std::this_thread::yield();
 }
 
-// How do I check whether the buffer is empty?
 template<typename T, size_t MAX_SIZE>
 inline std::optional<T> RingBuffer<T, MAX_SIZE>::dequeue(void) noexcept {
-    Index write_idx = eq_ticker_.load();
-    if (std::atomic_compare_exchange_strong(&dq_ticker_, &write_idx, 
-    Index read_idx = dq_ticker_.load();
-    
-    if (write_idx == eq_
-    
+    return try_dequeue();
+}
+
+template<typename T, size_t MAX_SIZE>
+bool RingBuffer<T, MAX_SIZE>::empty(void) const {
+    return size() == 0;
+}
+
+// Only a snapshot: elements can come and go while this is computed.
+template<typename T, size_t MAX_SIZE>
+size_t RingBuffer<T, MAX_SIZE>::size(void) const {
+    Index head = dq_ticker_.load();
+    Index tail = eq_ticker_.load();
+    return tail > head ? static_cast<size_t>(tail - head) : 0;
+}
+
+/********* START SPSC QUEUE *********/
+
+template<typename T, size_t MAX_SIZE>
+SPSCQueue<T, MAX_SIZE>::SPSCQueue(void):
+    SPSCQueue(nullptr)
+{}
+
+template<typename T, size_t MAX_SIZE>
+SPSCQueue<T, MAX_SIZE>::SPSCQueue(EventCount* idle):
+    head_(std::atomic<Index>(0)),
+    cached_tail_(0),
+    tail_(std::atomic<Index>(0)),
+    cached_head_(0),
+    idle_(idle)
+{}
+
+template<typename T, size_t MAX_SIZE>
+SPSCQueue<T, MAX_SIZE>::~SPSCQueue(void) {
+    while (try_dequeue().has_value()) continue;
+}
+
+template<typename T, size_t MAX_SIZE>
+inline typename SPSCQueue<T, MAX_SIZE>::Index SPSCQueue<T, MAX_SIZE>::idx(Index i) noexcept {
+    return i & (MAX_SIZE - 1);
 }
-*/
+
+template<typename T, size_t MAX_SIZE>
+template<typename S>
+bool SPSCQueue<T, MAX_SIZE>::try_enqueue(S&& item) noexcept(std::is_nothrow_constructible<T, S&&>::value) {
+    Index tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ == MAX_SIZE) {
+        // Looks full.  Find out how far the consumer has really got.
+        cached_head_ = head_.load(std::memory_order_acquire);
+        if (tail - cached_head_ == MAX_SIZE)
+            return false;
+    }
+    new (buff[idx(tail)].bytes) T(std::forward<S>(item));
+    tail_.store(tail + 1, std::memory_order_release);
+    if (idle_ != nullptr)
+        idle_->notifyAll();
+    return true;
+}
+
+template<typename T, size_t MAX_SIZE>
+template<typename S>
+inline void SPSCQueue<T, MAX_SIZE>::enqueue(S&& item) noexcept(std::is_nothrow_constructible<T, S&&>::value) {
+    while (!try_enqueue(std::forward<S>(item))) 
+        std::this_thread::yield();
+}
+
+template<typename T, size_t MAX_SIZE>
+std::optional<T> SPSCQueue<T, MAX_SIZE>::try_dequeue(void) noexcept {
+    Index head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_) {
+        // Looks empty.  Find out how far the producer has really got.
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+        if (head == cached_tail_)
+            return {};
+    }
+    T* elt = std::launder(reinterpret_cast<T*>(buff[idx(head)].bytes));
+    std::optional<T> out(std::move(*elt));
+    elt->~T();
+    head_.store(head + 1, std::memory_order_release);
+    return out;
+}
+
+template<typename T, size_t MAX_SIZE>
+inline std::optional<T> SPSCQueue<T, MAX_SIZE>::dequeue(void) noexcept {
+    return try_dequeue();
+}
+
+template<typename T, size_t MAX_SIZE>
+bool SPSCQueue<T, MAX_SIZE>::empty(void) const noexcept {
+    return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+}
+
+template<typename T, size_t MAX_SIZE>
+size_t SPSCQueue<T, MAX_SIZE>::size(void) const noexcept {
+    Index head = head_.load(std::memory_order_acquire);
+    Index tail = tail_.load(std::memory_order_acquire);
+    return tail > head ? static_cast<size_t>(tail - head) : 0;
+}
+
+/********* START STEALING DEQUE *********/
+
+template<typename T>
+StealingDeque<T>::Array::Array(int64_t capacity, Array* p):
+    mask(capacity - 1),
+    slots(new std::atomic<T>[capacity]),
+    prev(p)
+{}
+
+template<typename T>
+StealingDeque<T>::Array::~Array(void) {
+    delete[] slots;
+}
+
+template<typename T>
+inline T StealingDeque<T>::Array::get(int64_t i) const noexcept {
+    return slots[i & mask].load(std::memory_order_relaxed);
+}
+
+template<typename T>
+inline void StealingDeque<T>::Array::put(int64_t i, T value) noexcept {
+    slots[i & mask].store(value, std::memory_order_relaxed);
+}
+
+template<typename T>
+StealingDeque<T>::StealingDeque(size_t capacity):
+    top_(std::atomic<int64_t>(0)),
+    bottom_(std::atomic<int64_t>(0)),
+    array_(std::atomic<Array*>(nullptr))
+{
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    array_ = new Array(static_cast<int64_t>(size), nullptr);
+}
+
+template<typename T>
+StealingDeque<T>::~StealingDeque(void) {
+    Array* a = array_.load();
+    while (a != nullptr) {
+        Array* prev = a->prev;
+        delete a;
+        a = prev;
+    }
+}
+
+// Copy the live elements into an array twice the size.  Only the owner calls this, so nothing is pushed or
+// popped meanwhile, and thieves carry on reading the old array until they see the new one.
+template<typename T>
+typename StealingDeque<T>::Array* StealingDeque<T>::grow(Array* old, int64_t bottom, int64_t top) {
+    Array* a = new Array(2 * (old->mask + 1), old);
+    for (int64_t i = top; i < bottom; ++i) 
+        a->put(i, old->get(i));
+    array_.store(a, std::memory_order_release);
+    return a;
+}
+
+template<typename T>
+void StealingDeque<T>::push(T value) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+    if (b - t > a->mask) 
+        a = grow(a, b, t);
+    a->put(b, value);
+    // A release store rather than a release fence and a relaxed store: it's the same instruction on x86, and
+    // unlike a fence it's something ThreadSanitizer can pair with a thief's acquire of bottom_.
+    bottom_.store(b + 1, std::memory_order_release);
+}
+
+template<typename T>
+std::optional<T> StealingDeque<T>::pop(void) noexcept {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    // Claim the bottom element before looking at top, so that a thief either sees the claim or loses the race
+    // for the last element below.
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return {};
+    }
+    T value = a->get(b);
+    if (t == b) {
+        // The last element.  Thieves may be after it too, so it goes to whoever moves top first.
+        bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        if (!won)
+            return {};
+    }
+    return value;
+}
+
+template<typename T>
+std::optional<T> StealingDeque<T>::steal(void) noexcept {
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b)
+        return {};
+    Array* a = array_.load(std::memory_order_acquire);
+    T value = a->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return {};
+    return value;
+}
+
+template<typename T>
+bool StealingDeque<T>::empty(void) const noexcept {
+    return size() == 0;
+}
+
+template<typename T>
+size_t StealingDeque<T>::size(void) const noexcept {
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    int64_t t = top_.load(std::memory_order_acquire);
+    return b > t ? static_cast<size_t>(b - t) : 0;
+}
+
 } // end namespace Lockfree
 } // end namespace Cutter
@@ -1,7 +1,14 @@
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#ifndef __linux__
+#include <condition_variable>
+#endif
 #include <optional>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #ifndef LOCKFREEQUEUE_HPP
@@ -11,12 +18,34 @@ namespace Cutter {
 namespace Lockfree {
 
 constexpr int CACHE_LINE_SIZE = 64;
+// Lower bound on the number of retired nodes a thread accumulates before trying to reclaim them.
+constexpr size_t MIN_RLIST_SIZE = 64;
+// Number of node slots a thread moves between its private cache and the shared depot at a time.
+constexpr size_t NODE_BATCH_SIZE = 64;
+
+// A tagged pointer packs a 16 bit modification counter into the high bits of a 64 bit word, above the 48 bits
+// that user space addresses actually use.  Bumping the tag on every successful CAS is what defeats ABA for
+// stacks whose nodes can be popped and pushed back while another thread is still looking at them.
+using Tagged = uint64_t;
+constexpr int TAG_SHIFT = 48;
+constexpr Tagged PTR_MASK = (Tagged(1) << TAG_SHIFT) - 1;
+
+template<typename P> inline P* untag(Tagged) noexcept;
+inline Tagged retag(void*, Tagged) noexcept;
+
+// Number of hazard pointers in each record.  A thread owns one record, so this is how many objects a single
+// thread can protect at once.
+constexpr size_t HZD_SLOTS = 4;
 
 class Hzd;
 
+// The pool owning every hazard record.  Records are never freed while the pool is alive, which is what lets
+// scanners walk the list of all records without any synchronization, and lets released records sit on an
+// O(1) tagged pointer free list until some other thread wants one.
 class HzdMemPool {
 private:
-    std::atomic<Hzd*> head_;
+    std::atomic<Hzd*> head_;    // Every record ever allocated
+    std::atomic<Tagged> free_;  // Records which no thread currently owns
     std::atomic<size_t> len_;
 public:
     Hzd* alloc(void);
@@ -28,19 +57,29 @@ public:
     ~HzdMemPool(void);
 };
 
-class Hzd {
+class alignas(CACHE_LINE_SIZE) Hzd {
 private:
-    // TODO: Separate these onto different cache lines
-    std::atomic<Hzd*> next_;
-    std::atomic<void*> ptr_;
-    std::atomic<bool> active_;
+    // Written by the owning thread every time it protects something, and read by scanners.  Records are cache
+    // line aligned so that no two threads ever publish into the same line.
+    std::atomic<void*> ptrs_[HZD_SLOTS];
+    // Only touched when the record is acquired or released and when scanners walk the list, so these stay off
+    // the line being published into.
+    alignas(CACHE_LINE_SIZE) std::atomic<Hzd*> next_;
+    std::atomic<Hzd*> free_next_;
+    HzdMemPool* pool_;
     friend class HzdMemPool;
 public:
-    Hzd(void);
+    Hzd(HzdMemPool*);
     inline Hzd* next(void) const;
     inline std::atomic<void*>& operator*(void);
+    inline std::atomic<void*>& operator[](size_t);
+    inline void clear(void);
 };
 
+// Copies every published hazard pointer into out, sorted, so that it can be binary searched.  out is meant to
+// be a thread local buffer that is reused between scans, so in steady state this does not allocate.
+void snapshotHazards(Hzd*, std::vector<void*>& out);
+
 // This class simply takes care of thread local cleanup of hazard pointers.  
 class ThreadLocalHzdWrapper {
     Hzd* ptr;
@@ -52,18 +91,185 @@ public:
     ThreadLocalHzdWrapper& operator= (Hzd*&&);
     inline Hzd* operator->(void);
     inline std::atomic<void*>& operator*(void);
+    inline std::atomic<void*>& operator[](size_t);
+};
+
+// MEMORY RECLAMATION
+// The containers in this file are parameterized on a reclamation policy, which decides when memory unlinked
+// by one thread can safely be reused.  A policy R provides:
+//   R::Guard            RAII object held for the duration of one operation on a container.
+//     protect(i, src)   Load src and keep the result safe to dereference for as long as the guard lives.
+//     publish(i, p)     Keep p safe to dereference.  The caller must then check p is still reachable.
+//   R::retire(p, fn)    Hand over p once it has been unlinked.  fn(p) is called when no guard can reach it.
+//   R::quiesce()        Reclaim whatever this thread can right now, e.g. before it goes idle.
+// Each policy has a single domain shared by every container that uses it, rather than state per container
+// type.  Guards are not reentrant: a thread must not start an operation on one container in the middle of an
+// operation on another.
+
+struct Retired {
+    void* ptr;
+    void (*reclaim)(void*);
+    uint64_t epoch; // Only used by EpochBased
+};
+
+// Retired objects left behind by threads that exited before they could be reclaimed.  Live threads adopt them
+// the next time they try to reclaim anything.
+class Orphanage {
+private:
+    std::atomic<bool> any_;
+    std::mutex mtx_;
+    std::vector<Retired> orphans_;
+public:
+    Orphanage(void);
+    void give(std::vector<Retired>&);
+    void adopt(std::vector<Retired>&);
+};
+
+// Hazard pointers (Michael, "Hazard Pointers: Safe Memory Reclamation for Lock-Free Objects").  Every thread
+// owns a hazard record from the domain's pool and publishes the nodes it's about to dereference in its
+// slots.  A retired node is only reclaimed once a scan finds it in no thread's hazard records.  This costs a
+// seq_cst store per protected pointer, but bounds the amount of unreclaimed memory.
+class HazardPointers {
+public:
+    static constexpr size_t SLOTS = HZD_SLOTS;
+
+    class Domain {
+    private:
+        HzdMemPool pool_;
+        Orphanage orphans_;
+        friend class HazardPointers;
+    public:
+        HzdMemPool& pool(void);
+        size_t threshold(void);
+    };
+
+    class Guard {
+    private:
+        Hzd* hzd_;
+    public:
+        Guard(void);
+        template<typename N> inline N* protect(size_t, const std::atomic<N*>&) noexcept;
+        inline void publish(size_t, void*) noexcept;
+    };
+
+    static Domain& domain(void);
+    static void retire(void*, void (*)(void*));
+    static void quiesce(void);
+private:
+    struct ThreadState {
+        ThreadLocalHzdWrapper hzd;
+        std::vector<Retired> rlist;
+        std::vector<void*> snapshot;
+        ThreadState(void);
+        ~ThreadState(void);
+    };
+    static ThreadState& state(void);
+    static void scan(ThreadState&);
+};
+
+// Epoch based reclamation (Fraser, "Practical Lock-Freedom").  A thread announces the global epoch when it
+// starts an operation, and the epoch can only advance once every thread inside an operation has seen the
+// current one.  Whatever was retired in epoch e is unreachable by the time the global epoch reaches e + 2.
+// Entering an operation is one store to a thread's own cache line and guards nest, so a consumer can hold
+// a single guard across a whole batch of dequeues.  Frees happen in bulk whenever the epoch moves.  The
+// price is that one stalled thread stops reclamation for everybody.
+class EpochBased {
+public:
+    class Domain {
+    private:
+        struct alignas(CACHE_LINE_SIZE) Record {
+            std::atomic<uint64_t> state; // (epoch << 1) | 1 while inside an operation, 0 otherwise
+            std::atomic<bool> active;    // Whether some thread owns this record
+            Record* next;
+            Record(void);
+        };
+
+        alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> epoch_;
+        alignas(CACHE_LINE_SIZE) std::atomic<Record*> records_;
+        Orphanage orphans_;
+        friend class EpochBased;
+
+        Record* acquire(void);
+        static void release(Record*);
+    public:
+        Domain(void);
+        ~Domain(void);
+        uint64_t epoch(void) const;
+        bool tryAdvance(void);
+    };
+
+    class Guard {
+    public:
+        Guard(void);
+        ~Guard(void);
+        Guard(const Guard&) = delete;
+        Guard& operator= (const Guard&) = delete;
+        template<typename N> inline N* protect(size_t, const std::atomic<N*>&) noexcept;
+        inline void publish(size_t, void*) noexcept;
+    };
+
+    static Domain& domain(void);
+    static void retire(void*, void (*)(void*));
+    static void quiesce(void);
+private:
+    struct ThreadState {
+        Domain::Record* record;
+        size_t depth;
+        std::vector<Retired> limbo;
+        ThreadState(void);
+        ~ThreadState(void);
+    };
+    static ThreadState& state(void);
+    static void collect(ThreadState&);
+};
+
+// Lets consumers of a lock free container go to sleep while it's empty, without costing producers anything
+// when nobody is asleep.  A consumer calls prepareWait(), checks the container one last time, and then either
+// cancelWait()s or wait()s with the key it was handed.  A producer calls notify() after publishing, which is a
+// fence and a load unless somebody is waiting.  Every wakeup changes the key, so a notify() that lands between
+// prepareWait() and wait() makes the wait return immediately instead of getting lost.  Threads sleep on a
+// futex on Linux and on a condition variable everywhere else.
+class EventCount {
+private:
+    std::atomic<uint32_t> key_;
+    std::atomic<uint32_t> waiters_;
+#ifndef __linux__
+    std::mutex mtx_;
+    std::condition_variable cv_;
+#endif
+    void wake(bool all) noexcept;
+public:
+    EventCount(void);
+    EventCount(const EventCount&) = delete;
+    EventCount& operator= (const EventCount&) = delete;
+
+    inline uint32_t prepareWait(void) noexcept;
+    inline void cancelWait(void) noexcept;
+    // Sleeps until notified, the timeout expires, or a spurious wakeup.  Callers re-check their condition.
+    template<typename Rep, typename Period>
+    void wait(uint32_t key, const std::chrono::duration<Rep, Period>& timeout) noexcept;
+    // Sleeps until notified or a spurious wakeup.  Only for callers that are sure somebody will notify().
+    inline void wait(uint32_t key) noexcept;
+    inline void notify(void) noexcept;
+    inline void notifyAll(void) noexcept;
 };
 
 template<typename T>
 struct Node {
     typedef T value_type;
     
-    // Consider adding a "taken" flag to enable move semantics
-    T value;
+    // First, so that it shares its word with NodePool's link to the next batch.  Lock free readers may load
+    // either from a slot that has just been recycled, so that word is only ever written atomically: the
+    // constructors store to it rather than initialise it.
     std::atomic<Node<T> *> next;
+    // The value is only alive while the node sits behind the sentinel.  The sentinel never holds one: the
+    // consumer that swings head onto a node moves its value out and destroys it, and the node becomes the
+    // new sentinel.  This is what lets T be move-only and not default constructible.
+    union { T value; };
     
     Node(void);
-    template<typename S> Node(S&&);
+    template<typename... Args> Node(std::in_place_t, Args&&...);
+    ~Node(void);
 
     inline Node<T>& operator++ (void);
     inline Node<T> operator++ (int);
@@ -73,44 +279,178 @@ struct Node {
     inline T* operator-> (void);
 };
 
+// Where NodePool gets its blocks from, if not the heap.  The source is asked for bytes aligned to align and
+// returns nullptr when it can't oblige, in which case the block comes from the heap after all.  Blocks are
+// never handed back, so whatever backs the source has to stay mapped until the program exits.  See
+// Memory::NodeArena, which puts the nodes on huge pages.
+class NodeSource {
+public:
+    using Allocate = void* (*)(size_t bytes, size_t align) noexcept;
+    // Only affects blocks allocated from here on.  nullptr goes back to the heap.
+    static void set(Allocate) noexcept;
+    static void* allocate(size_t bytes, size_t align) noexcept;
+private:
+    static inline std::atomic<Allocate> allocate_{nullptr};
+};
+
+// Storage for the nodes of the lock free containers.  Node sized slots are carved out of blocks of
+// NODE_BATCH_SIZE and each thread keeps a private cache of free slots, so the usual alloc/free pair is a
+// couple of pointer swaps and never touches the allocator.  Whole batches are exchanged with a shared depot
+// when a thread runs dry or its cache overflows, which is how consumer threads hand recycled nodes back to
+// producer threads.  Blocks are never released.  Thread caches and static containers can still be handing
+// nodes back while static destructors run, so the depot has no destructor to race with them.
+template<typename N>
+class NodePool {
+private:
+    // A free slot reuses the node's storage to hold its free list links.  next_batch overlays the node's next,
+    // and like it is only ever written atomically, since popBatch can read it from a slot another thread has
+    // already taken.  Links are never initialised as a whole, so making one doesn't write to it.
+    struct Link {
+        std::atomic<Link*> next_batch;  // Next batch in the depot, only meaningful at the head of a batch
+        Link* next;                     // Next free slot in the same batch
+        size_t count;                   // Number of slots in the batch, only meaningful at the head of a batch
+    };
+    static_assert(std::is_trivially_default_constructible<Link>::value, "Making a Link mustn't write to it.");
+
+    struct alignas(alignof(N) > alignof(Link) ? alignof(N) : alignof(Link)) Slot {
+        unsigned char bytes[sizeof(N) > sizeof(Link) ? sizeof(N) : sizeof(Link)];
+    };
+
+    // Lives in the first slot of every heap block, so that they all stay reachable from depot_ and leak checkers
+    // don't report them.  Blocks from the NodeSource aren't linked: a leak checker may not look inside them.
+    struct Header {
+        Slot* next;
+    };
+    static_assert(sizeof(Header) <= sizeof(Slot), "A block header has to fit in a slot.");
+
+    struct Cache {
+        Link* head;
+        size_t count;
+        Cache(void);
+        ~Cache(void);
+    };
+
+    struct Depot {
+        std::atomic<Tagged> top;
+        std::atomic<Slot*> blocks;
+        constexpr Depot(void);
+    };
+    static_assert(std::is_trivially_destructible<Depot>::value, "Nothing may run when the depot goes away.");
+
+    static inline Depot depot_;
+    thread_local static Cache cache_;
+
+    static Link* grow(void);
+    static Link* popBatch(void) noexcept;
+    static void pushBatch(Link*, size_t) noexcept;
+public:
+    static void* alloc(void);
+    static void free(void*) noexcept;
+};
+
 // This class is a multi producer, multi consumer lock free queue.  It is a C++ adaptation of the Michael-Scott queue (Simple, Fast, and Practical Non-Blocking and Blocking Concurrent Queue Algorithms)
-template<typename T>
+template<typename T, typename R = HazardPointers>
 class Queue {
 private:
     // The padding is to put the head and tail on different cache lines so that there is no contention between producers and consumers.
-    std::atomic<Node<T>*> head;
-    char paddingOne[CACHE_LINE_SIZE - sizeof(std::atomic<Node<T> *>)];
+    // Each side keeps its count of elements next to its own end of the queue, so counting costs nothing
+    // beyond the line that side is already fighting over.
+    alignas(CACHE_LINE_SIZE) std::atomic<Node<T>*> head;
+    std::atomic<size_t> dequeued_;
+    char paddingOne[CACHE_LINE_SIZE - sizeof(std::atomic<Node<T> *>) - sizeof(std::atomic<size_t>)];
     
     std::atomic<Node<T>*> tail;
-    char paddingTwo[CACHE_LINE_SIZE - sizeof(std::atomic<Node<T> *>)];
-    
-    std::atomic<size_t> size_;
+    std::atomic<size_t> enqueued_;
+    char paddingTwo[CACHE_LINE_SIZE - sizeof(std::atomic<Node<T> *>) - sizeof(std::atomic<size_t>)];
 
-    static void retire(Node<T>*);
+    // Consumers that found the queue empty sleep on idle_.  Producers only read it unless somebody is asleep.  It
+    // points at own_ unless the queue was given an EventCount to share with other containers.
+    EventCount own_;
+    EventCount* idle_;
+
+    using Pool = NodePool<Node<T>>;
+    template<typename... S> static inline Node<T>* makeNode(S&&...);
+    static inline void destroyNode(Node<T>*) noexcept;
+    static void reclaim(void*);
+    void link(Node<T>*, Node<T>*) noexcept;
 public:
     using iterator = Node<T>*;
+    using reclamation = R;
     Queue(void);
+    // Notifies idle instead of an EventCount of its own, so that a consumer can park on several containers at once.
+    // Every thread parked on idle must be willing to take from this queue, since enqueue only wakes one of them.
+    explicit Queue(EventCount* idle);
     ~Queue(void);
     
+    // Exact at the instant head is read: the queue is empty when the sentinel has no successor.
     inline bool empty(void) const noexcept;
     template<typename S>
     void enqueue(S&& value) noexcept;
+    template<typename... Args>
+    void emplace(Args&&... args) noexcept;
     std::optional<T> dequeue(void) noexcept;
+    // Like dequeue, but parks the calling thread for up to timeout while the queue is empty.  It can return
+    // empty before the timeout (e.g. another consumer took the element it was woken for), so call it in a loop.
+    template<typename Rep, typename Period>
+    std::optional<T> dequeue_wait(const std::chrono::duration<Rep, Period>& timeout) noexcept;
+    // Wakes every thread parked in dequeue_wait, e.g. so that they notice a shutdown.
+    void wake_all(void) noexcept;
+    // Links [first, last) into a private chain and splices it onto the tail with a single CAS.
+    template<typename InputIt>
+    size_t enqueue_bulk(InputIt first, InputIt last) noexcept;
+    // Claims up to max elements with a single CAS on head and writes them to out.  Returns the number taken.
+    template<typename OutputIt>
+    size_t dequeue_bulk(OutputIt out, size_t max) noexcept;
     iterator begin(void) noexcept;
     iterator end(void) noexcept;
+    // Approximate while other threads are enqueueing or dequeueing.
     size_t size(void) const;
-    static inline std::unique_ptr<HzdMemPool> mempool = std::make_unique<HzdMemPool>();
-    thread_local static ThreadLocalHzdWrapper hptr_a;
-    thread_local static ThreadLocalHzdWrapper hptr_b;
-    thread_local static std::vector<Node<T>*> rlist;
-    static size_t MAX_RLIST_SIZE(void);
-    static void scan(Hzd*);
+};
+
+// This class is a multi producer, multi consumer lock free stack (Treiber's stack).  The top of the stack is a
+// tagged pointer, so a node that is popped and pushed back while another thread is looking at it can't fool
+// that thread's CAS (the ABA problem).  Nodes come from the same NodePool as the queue's, and since that never
+// gives memory back, reading through a stale top is harmless without any further reclamation scheme.  LIFO order
+// means the element popped is the one most recently pushed, which is what you want from a free list: it's the
+// one most likely to still be in cache.
+template<typename T>
+class Stack {
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<Tagged> top_;
+    char padding[CACHE_LINE_SIZE - sizeof(std::atomic<Tagged>)];
+
+    using Pool = NodePool<Node<T>>;
+    void link(Node<T>*, Node<T>*) noexcept;
+public:
+    Stack(void);
+    ~Stack(void);
+
+    Stack(const Stack&) = delete;
+    Stack& operator= (const Stack&) = delete;
+
+    bool empty(void) const noexcept;
+    template<typename S>
+    void push(S&& value) noexcept;
+    template<typename... Args>
+    void emplace(Args&&... args) noexcept;
+    std::optional<T> pop(void) noexcept;
+    // Pushes [first, last) with a single CAS.  The last element ends up on top.
+    template<typename InputIt>
+    size_t push_bulk(InputIt first, InputIt last) noexcept;
+    // Pops up to max elements with a single CAS and writes them to out, top first.  Returns the number taken.
+    template<typename OutputIt>
+    size_t pop_bulk(OutputIt out, size_t max) noexcept;
 };
 
 constexpr bool isPowerOfTwo(size_t v) {
     return v && ((v & (v - 1)) == 0);
 }
 
+// This class is a bounded multi producer, multi consumer queue over a fixed array (Vyukov's bounded MPMC queue).
+// Every slot carries a sequence number which tells a producer holding ticket t whether the slot is free for
+// lap t / MAX_SIZE, and a consumer whether it has been filled for that lap.  Producers and consumers each claim
+// tickets with a single CAS on their own counter, and the two counters live on separate cache lines.  Nothing
+// is ever allocated after construction.
 // MAX SIZE MUST BE A POWER OF TWO
 template<typename T, size_t MAX_SIZE = 4096>
 class RingBuffer {
@@ -120,17 +460,138 @@ class RingBuffer {
     ); 
 private:
     using Index = uint64_t;
-    T buff[MAX_SIZE];
-    std::atomic<Index> eq_ticker_;
-    std::atomic<Index> dq_ticker_;
 
-    inline uint64_t idx(Index) noexcept;
+    struct Cell {
+        std::atomic<Index> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<Index> eq_ticker_;
+    alignas(CACHE_LINE_SIZE) std::atomic<Index> dq_ticker_;
+    alignas(CACHE_LINE_SIZE) Cell buff[MAX_SIZE];
+
+    static inline Index idx(Index) noexcept;
 public:
     static constexpr size_t max_size = MAX_SIZE;
     RingBuffer(void);
-    template<typename S> inline void enqueue(S&&) noexcept;
+    ~RingBuffer(void);
+
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator= (const RingBuffer&) = delete;
+
+    // Returns false if the buffer is full.  Only throws if constructing a T from S does, and then the buffer is
+    // left as it was.
+    template<typename S> bool try_enqueue(S&&) noexcept(std::is_nothrow_constructible<T, S&&>::value);
+    // Returns nothing if the buffer is empty.
+    std::optional<T> try_dequeue(void) noexcept;
+    // Spins until there is space.
+    template<typename S> inline void enqueue(S&&) noexcept(std::is_nothrow_constructible<T, S&&>::value);
     inline std::optional<T> dequeue(void) noexcept;
     bool empty(void) const;
+    size_t size(void) const;
+};
+
+// This class is a bounded single producer, single consumer queue.  With only one thread on each end there is no
+// need for any CAS: the producer owns tail_ and the consumer owns head_, and each publishes its index with a
+// release store.  Each side also keeps a private copy of the other side's index and only re-reads the shared
+// one when the copy says the queue is full (or empty), so in the common case neither side touches the other's
+// cache line at all.  Using it from more than one producer or more than one consumer thread is a data race.
+// MAX SIZE MUST BE A POWER OF TWO
+template<typename T, size_t MAX_SIZE = 4096>
+class SPSCQueue {
+    static_assert(
+        isPowerOfTwo(MAX_SIZE), 
+        "SPSC queue must have max size a power of two."
+    ); 
+private:
+    using Index = uint64_t;
+
+    struct alignas(T) Slot {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    // Consumer side
+    alignas(CACHE_LINE_SIZE) std::atomic<Index> head_;
+    Index cached_tail_;
+    // Producer side
+    alignas(CACHE_LINE_SIZE) std::atomic<Index> tail_;
+    Index cached_head_;
+    EventCount* idle_;
+    alignas(CACHE_LINE_SIZE) Slot buff[MAX_SIZE];
+
+    static inline Index idx(Index) noexcept;
+public:
+    static constexpr size_t max_size = MAX_SIZE;
+    SPSCQueue(void);
+    // Notifies idle after every enqueue, for a consumer that parks on it.  The consumer may share idle with other
+    // sleepers, so this wakes all of them.
+    explicit SPSCQueue(EventCount* idle);
+    ~SPSCQueue(void);
+
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue& operator= (const SPSCQueue&) = delete;
+
+    // Producer only.  Returns false if the queue is full.  Only throws if constructing a T from S does, and then
+    // the queue is left as it was.
+    template<typename S> bool try_enqueue(S&&) noexcept(std::is_nothrow_constructible<T, S&&>::value);
+    // Producer only.  Spins until there is space.
+    template<typename S> inline void enqueue(S&&) noexcept(std::is_nothrow_constructible<T, S&&>::value);
+    // Consumer only.  Returns nothing if the queue is empty.
+    std::optional<T> try_dequeue(void) noexcept;
+    inline std::optional<T> dequeue(void) noexcept;
+    bool empty(void) const noexcept;
+    size_t size(void) const noexcept;
+};
+
+// This class is a work stealing deque (Chase and Lev, "Dynamic Circular Work-Stealing Deque", with the memory
+// orderings of Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").  One thread owns it and
+// pushes and pops at the bottom, last in first out, so it works on whatever it made most recently while that's
+// still in cache.  Any other thread can steal from the top, taking the oldest element, which for recursively split
+// work is the biggest piece.  The owner only needs a CAS when it's down to the last element.  The array doubles
+// when it fills up, and outgrown arrays are kept until the deque goes away because a thief may still be reading
+// one, so at most twice the peak size is ever allocated.  T must be trivially copyable (a pointer, usually): a
+// thief can read a slot that is being overwritten, and only finds out afterwards that its steal failed.
+template<typename T>
+class StealingDeque {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Stealing deque elements must be trivially copyable."
+    );
+private:
+    struct Array {
+        const int64_t mask;
+        std::atomic<T>* slots;
+        Array* prev;    // The array this one outgrew
+        Array(int64_t capacity, Array* prev);
+        ~Array(void);
+        inline T get(int64_t i) const noexcept;
+        inline void put(int64_t i, T value) noexcept;
+    };
+
+    // Thieves fight over top_, and the owner only ever writes bottom_.
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top_;
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom_;
+    std::atomic<Array*> array_;
+
+    Array* grow(Array*, int64_t bottom, int64_t top);
+public:
+    // Capacity is rounded up to a power of two.
+    explicit StealingDeque(size_t capacity = 256);
+    ~StealingDeque(void);
+
+    StealingDeque(const StealingDeque&) = delete;
+    StealingDeque& operator= (const StealingDeque&) = delete;
+
+    // Owner only.
+    void push(T value);
+    // Owner only.  The element pushed most recently.
+    std::optional<T> pop(void) noexcept;
+    // Any thread.  The oldest element.  Comes back empty if another thread took it first, so it can fail while
+    // the deque still holds something.
+    std::optional<T> steal(void) noexcept;
+    // Approximate while other threads are stealing.
+    bool empty(void) const noexcept;
+    size_t size(void) const noexcept;
 };
 
 } // end namespace Lockfree
@@ -1,6 +1,26 @@
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <atomic>
-#include <future>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -10,29 +30,471 @@
 namespace Cutter {
 namespace Memory {
 
+inline ThreadSlot::Holder::Holder(void) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!free_.empty()) {
+        id = free_.back();
+        free_.pop_back();
+    }
+    else {
+        id = next_ < MAX_THREAD_SLOTS ? next_++ : NONE;
+    }
+}
+
+inline ThreadSlot::Holder::~Holder(void) {
+    if (id == NONE)
+        return;
+    std::lock_guard<std::mutex> lock(mtx_);
+    free_.push_back(id);
+}
+
+inline size_t ThreadSlot::id(void) {
+    thread_local Holder holder;
+    return holder.id;
+}
+
+/********* START NUMA *********/
+
+// Parse a sysfs cpu or node list, like "0-3,8-11", into its highest entry plus one and a callback for each entry.
+template<typename F>
+inline size_t parseSysfsList(const std::string& path, F&& each) {
+    std::ifstream in(path);
+    std::string range;
+    size_t count = 0;
+    while (std::getline(in, range, ',')) {
+        size_t first, last;
+        char dash;
+        std::istringstream parse(range);
+        if (!(parse >> first))
+            break;
+        last = (parse >> dash >> last) ? last : first;
+        for (size_t i = first; i <= last; ++i) 
+            each(i);
+        count = std::max(count, last + 1);
+    }
+    return count;
+}
+
+inline size_t Numa::nodes(void) {
+    static const size_t count = std::max<size_t>(1, parseSysfsList("/sys/devices/system/node/online", [] (size_t) {}));
+    return count;
+}
+
+inline const std::vector<size_t>& Numa::cpuNodes(void) {
+    static const std::vector<size_t> map = [] (void) {
+        std::vector<size_t> map;
+        for (size_t node = 0; node < nodes(); ++node) {
+            parseSysfsList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", [&] (size_t cpu) {
+                if (map.size() <= cpu) map.resize(cpu + 1, 0);
+                map[cpu] = node;
+            });
+        }
+        return map;
+    }();
+    return map;
+}
+
+// sched_getcpu goes through the vDSO, so this is cheap enough to ask on every allocation.
+inline size_t Numa::node(void) {
+    if (nodes() == 1)
+        return 0;
+    int cpu = sched_getcpu();
+    const auto& map = cpuNodes();
+    return (cpu < 0 || static_cast<size_t>(cpu) >= map.size()) ? 0 : map[cpu];
+}
+
+// Failing to bind only costs locality, so errors are ignored.
+inline void Numa::bind(void* addr, size_t bytes, size_t node) {
+    if (node == ANY || nodes() == 1)
+        return;
+    constexpr size_t BITS = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> mask(node / BITS + 1, 0);
+    mask[node / BITS] |= 1ul << (node % BITS);
+    syscall(SYS_mbind, addr, bytes, PREFERRED_POLICY, mask.data(), mask.size() * BITS + 1, 0);
+}
+
+/********* START ARENA *********/
+
+inline size_t Arena::pageSize(void) {
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+// The default huge page size, from the "Hugepagesize:" line of /proc/meminfo.
+inline size_t Arena::hugePageSize(void) {
+    static const size_t size = [] (void) {
+        std::ifstream in("/proc/meminfo");
+        std::string key;
+        size_t kb;
+        while (in >> key) {
+            if (key == "Hugepagesize:" && in >> kb)
+                return kb << 10;
+            in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        return DEFAULT_HUGE_PAGE_SIZE;
+    }();
+    return size;
+}
+
+inline size_t Arena::roundUp(size_t bytes) const {
+    return (bytes + granule_ - 1) / granule_ * granule_;
+}
+
+// Reserve bytes of address space starting on a multiple of align, or return nullptr if the kernel won't.  The
+// mapping is made big enough to contain an aligned range, and whatever hangs over either end is unmapped.
+inline char* Arena::map(size_t bytes, size_t align, int flags) {
+    size_t slop = align - pageSize();
+    void* addr = mmap(nullptr, bytes + slop, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    char* start = static_cast<char*>(addr);
+    char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(start) + align - 1) / align * align);
+    if (aligned != start)
+        munmap(start, aligned - start);
+    if (size_t tail = (start + bytes + slop) - (aligned + bytes))
+        munmap(aligned + bytes, tail);
+    return aligned;
+}
+
+inline Arena::Arena(size_t reserve, size_t node, Pages pages):
+    mtx_(),
+    regions_(),
+    n_regions_(std::atomic<size_t>(0)),
+    used_(0),
+    reserve_(0),
+    node_(node),
+    released_(),
+    pages_(pages),
+    granule_(pages == Pages::Normal ? pageSize() : hugePageSize())
+{
+    reserve_ = roundUp(reserve);
+    char* base = nullptr;
+    // Huge pages are set aside by the mmap itself (hence no MAP_NORESERVE), so a shortage shows up here rather
+    // than as a SIGBUS the first time a page is touched.
+    if (pages_ == Pages::Huge) {
+        base = map(reserve_, pageSize(), MAP_HUGETLB);
+        if (base == nullptr)
+            pages_ = Pages::Transparent;
+    }
+    // Transparent huge pages only back ranges aligned to a huge page, so the mapping has to start on one.
+    if (pages_ == Pages::Transparent) {
+        base = map(reserve_, granule_, MAP_NORESERVE);
+        if (base != nullptr && madvise(base, reserve_, MADV_HUGEPAGE) != 0)
+            pages_ = Pages::Normal;
+    }
+    if (base == nullptr)
+        base = map(reserve_, pageSize(), MAP_NORESERVE);
+    if (base == nullptr)
+        throw std::bad_alloc();
+    add(base, reserve_);
+}
+
+inline Arena::~Arena(void) {
+    for (size_t i = 0; i < n_regions_.load(); ++i) 
+        munmap(regions_[i].base, regions_[i].size);
+}
+
+inline void Arena::add(char* base, size_t size) {
+    Numa::bind(base, size, node_);
+    size_t n = n_regions_.load(std::memory_order_relaxed);
+    regions_[n] = Region{base, size};
+    n_regions_.store(n + 1, std::memory_order_release);
+    used_ = 0;
+}
+
+// Reserves a region with the pages the first one ended up with.  Called with the lock held.
+inline void Arena::grow(size_t bytes) {
+    size_t n = n_regions_.load(std::memory_order_relaxed);
+    if (n == MAX_ARENA_REGIONS)
+        throw std::bad_alloc();
+    size_t size = std::max(reserve_, bytes);
+    char* base = nullptr;
+    if (pages_ == Pages::Huge) 
+        base = map(size, pageSize(), MAP_HUGETLB);
+    else if (pages_ == Pages::Transparent) {
+        base = map(size, granule_, MAP_NORESERVE);
+        if (base != nullptr)
+            madvise(base, size, MADV_HUGEPAGE);
+    }
+    else 
+        base = map(size, pageSize(), MAP_NORESERVE);
+    if (base == nullptr)
+        throw std::bad_alloc();
+    // What's left of the old region is still good for smaller blocks.
+    const Region& last = regions_[n - 1];
+    if (used_ < last.size)
+        released_.emplace(last.size - used_, last.base + used_);
+    add(base, size);
+}
+
+inline void* Arena::allocate(size_t bytes) {
+    bytes = roundUp(bytes);
+    std::lock_guard<std::mutex> lock(mtx_);
+    // The smallest released range that fits, with whatever's left over released again.
+    auto it = released_.lower_bound(bytes);
+    if (it != released_.end()) {
+        auto [size, ptr] = *it;
+        released_.erase(it);
+        if (size > bytes)
+            released_.emplace(size - bytes, ptr + bytes);
+        return ptr;
+    }
+    Region* last = &regions_[n_regions_.load(std::memory_order_relaxed) - 1];
+    if (last->size - used_ < bytes) {
+        grow(bytes);
+        last = &regions_[n_regions_.load(std::memory_order_relaxed) - 1];
+    }
+    char* ptr = last->base + used_;
+    used_ += bytes;
+    return ptr;
+}
+
+inline void Arena::deallocate(void* ptr, size_t bytes) {
+    bytes = roundUp(bytes);
+    madvise(ptr, bytes, MADV_DONTNEED);
+    std::lock_guard<std::mutex> lock(mtx_);
+    released_.emplace(bytes, static_cast<char*>(ptr));
+}
+
+// There are only ever a handful of regions, so a linear search is as quick as anything.
+inline bool Arena::owns(const void* ptr) const {
+    auto p = static_cast<const char*>(ptr);
+    size_t n = n_regions_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i) {
+        const Region& region = regions_[i];
+        if (std::less_equal<const char*>()(region.base, p) && std::less<const char*>()(p, region.base + region.size))
+            return true;
+    }
+    return false;
+}
+
+inline Pages Arena::pages(void) const {
+    return pages_;
+}
+
+inline size_t Arena::granule(void) const {
+    return granule_;
+}
+
+/********* START NODE ARENA *********/
+
+inline NodeArena::NodeArena(Pages pages, size_t reserve):
+    mtx_(),
+    arena_(reserve, Numa::ANY, pages),
+    next_(nullptr),
+    end_(nullptr)
+{}
+
+// Node blocks are small, so they're bumped out of a granule at a time.  Anything bigger than a granule gets a
+// range of its own.
+inline void* NodeArena::allocate(size_t bytes, size_t align) noexcept {
+    NodeArena* self = instance_.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(self->mtx_);
+    try {
+        if (bytes > self->arena_.granule())
+            return self->arena_.allocate(bytes);
+        char* ptr = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(self->next_) + align - 1) / align * align);
+        if (self->next_ == nullptr || ptr + bytes > self->end_) {
+            ptr = static_cast<char*>(self->arena_.allocate(self->arena_.granule()));
+            self->end_ = ptr + self->arena_.granule();
+        }
+        self->next_ = ptr + bytes;
+        return ptr;
+    }
+    catch (const std::bad_alloc&) {
+        // The reservation's used up.  The node pool will go to the heap instead.
+        return nullptr;
+    }
+}
+
+inline Pages NodeArena::install(Pages pages, size_t reserve) {
+    // Never deleted: node blocks outlive every static destructor that could delete it.
+    static NodeArena* arena = [&] (void) {
+        auto arena = new NodeArena(pages, reserve);
+        instance_.store(arena, std::memory_order_release);
+        Cutter::Lockfree::NodeSource::set(&NodeArena::allocate);
+        return arena;
+    }();
+    return arena->arena_.pages();
+}
+
+inline bool NodeArena::owns(const void* ptr) {
+    NodeArena* arena = instance_.load(std::memory_order_acquire);
+    return arena != nullptr && arena->arena_.owns(ptr);
+}
+
+/********* START OBJECT POOL *********/
+
+template<typename T>
+void Reset<T>::reset(T& obj) {
+    if constexpr (has_Clear<T>::value)
+        obj.Clear();
+    else if constexpr (has_clear<T>::value)
+        obj.clear();
+}
+
+template<typename T>
+ObjectPool<T>::Magazine::Magazine(void): count(0) {}
+
+template<typename T>
+ObjectPool<T>::Tally::Tally(void):
+    fresh(std::atomic<size_t>(0)),
+    reused(std::atomic<size_t>(0)),
+    returned(std::atomic<size_t>(0))
+{}
+
+inline Refiller::Refiller(void):
+    jobs_(),
+    stopped_(std::atomic<bool>(false)),
+    worker_()
+{
+    // The worker uses the reclamation domain right up until it's joined in our destructor.  Statics are destroyed
+    // in the reverse order they were built, so the domain has to be built before we are.
+    decltype(jobs_)::reclamation::domain();
+    worker_ = std::thread([this] (void) {
+        while (!stopped_.load()) {
+            auto job = jobs_.dequeue_wait(std::chrono::milliseconds(100));
+            if (job) (*job)();
+        }
+        // Pools wait on their refills before they go away, so everything submitted has to be run.
+        while (auto job = jobs_.dequeue()) (*job)();
+        decltype(jobs_)::reclamation::quiesce();
+    });
+}
+
+inline Refiller::~Refiller(void) {
+    stopped_ = true;
+    jobs_.wake_all();
+    worker_.join();
+}
+
+inline Refiller& Refiller::instance(void) {
+    static Refiller refiller;
+    return refiller;
+}
+
+inline void Refiller::submit(std::function<void()> job) {
+    jobs_.enqueue(std::move(job));
+}
+
 template<typename T>
-ObjectPool<T>::ObjectPool(void):
-    // This will initialize our buffer for space to hold DEFAULT_BUFFER_SIZE objects
-    blocks_{new T[Cutter::Const::DEFAULT_BUFFER_SIZE]},
+ObjectPool<T>::ObjectPool(size_t block_size, Growth growth, size_t max_block_size, size_t prealloc, Arena* arena):
+    arena_(arena),
+    // This will initialize our buffer for space to hold block_size objects
+    blocks_{newBlock(block_size)},
     // This is the location of the current pointer to allocate
     current_(std::atomic<T*>(blocks_[0])),
     // This is the location of the last pointer in the block
-    last_(std::next(blocks_[0], Cutter::Const::DEFAULT_BUFFER_SIZE - 1)),
+    last_(std::next(blocks_[0], block_size - 1)),
+    blocks_mtx_(),
+    block_sizes_{block_size},
+    block_size_(block_size),
+    growth_(growth),
+    max_block_size_(std::max(block_size, max_block_size)),
+    spare_(),
+    next_(std::atomic<T*>(nullptr)),
+    next_size_(0),
+    refilling_(std::atomic<bool>(false)),
+    // This list contains previously freed memory to be reused.  It's a stack so that the most recently freed
+    // object, which is the one most likely to still be in cache, is the first to be handed out again.
+    free_(),
+    cleaned_(),
+    shared_cached_(std::atomic<ptrdiff_t>(0)),
+    high_watermark_(std::atomic<size_t>(0)),
+    trimmed_(std::atomic<size_t>(0)),
+    tally_(),
+    locals_()
+{
+    for (size_t capacity = block_size, size = block_size; capacity < prealloc; capacity += size) {
+        size = nextBlockSize(size);
+        spare_.emplace_back(newBlock(size), size);
+    }
+    // Spare blocks are taken from the back.
+    std::reverse(spare_.begin(), spare_.end());
     // This launches the task to fetch the next block
-    next_(std::async(
-        std::launch::async, 
-        [] (void) { 
-            return new T[Cutter::Const::DEFAULT_BUFFER_SIZE];
-        })
-    ),
-    // This list contains previously freed memory to be reused
-    free_(Cutter::Lockfree::Queue<T*>())
-{}
+    refill();
+}
 
 template<typename T>
 ObjectPool<T>::~ObjectPool(void) {
-    for (auto& ptr : blocks_) delete[] ptr;
-    delete[] next_.get();
+    // The refill holds on to this, so it has to land before we can go.
+    while (refilling_.load()) std::this_thread::yield();
+    // Cleaned objects are the only ones the pool knows to be alive.
+    for (auto& slot : locals_) {
+        Local* local = slot.load();
+        if (local == nullptr) continue;
+        for (size_t i = 0; i < local->cleaned.count; ++i) 
+            local->cleaned.objs[i]->~T();
+        delete local;
+    }
+    while (auto obj = cleaned_.pop()) 
+        (*obj)->~T();
+    for (size_t i = 0; i < blocks_.size(); ++i) deleteBlock(blocks_[i], block_sizes_[i]);
+    for (auto& block : spare_) deleteBlock(block.first, block.second);
+    if (T* block = next_.load()) deleteBlock(block, next_size_);
+}
+
+template<typename T>
+inline T* ObjectPool<T>::newBlock(size_t size) {
+    if (arena_ != nullptr)
+        return static_cast<T*>(arena_->allocate(size * sizeof(Slot)));
+    return reinterpret_cast<T*>(new Slot[size]);
+}
+
+template<typename T>
+inline void ObjectPool<T>::deleteBlock(T* block, size_t size) {
+    if (arena_ != nullptr)
+        arena_->deallocate(block, size * sizeof(Slot));
+    else
+        delete[] reinterpret_cast<Slot*>(block);
+}
+
+template<typename T>
+inline size_t ObjectPool<T>::nextBlockSize(size_t after) {
+    if (growth_ == Growth::Fixed)
+        return block_size_;
+    return std::min(max_block_size_, 2 * after);
+}
+
+// Have the refiller allocate the next block, unless one is already on its way or there are spares left.
+template<typename T>
+void ObjectPool<T>::refill(void) {
+    if (!spare_.empty() || next_.load() != nullptr || refilling_.load())
+        return;
+    refilling_ = true;
+    size_t size = nextBlockSize(block_sizes_.back());
+    Refiller::instance().submit([this, size] (void) {
+        T* block = newBlock(size);
+        next_size_ = size;
+        next_.store(block);
+        refilling_ = false;
+    });
+}
+
+// Only ever called by the thread that won the CAS of current_ from last_ to nullptr, so it has the block
+// bookkeeping to itself.
+template<typename T>
+void ObjectPool<T>::swapBlock(void) {
+    std::lock_guard<std::mutex> lock(blocks_mtx_);
+    T* block;
+    size_t size;
+    if (!spare_.empty()) {
+        std::tie(block, size) = spare_.back();
+        spare_.pop_back();
+    }
+    else if ((block = next_.exchange(nullptr)) != nullptr) {
+        size = next_size_;
+    }
+    else {
+        // The refill hasn't landed yet.  Rather than wait for it, allocate the block here.
+        size = nextBlockSize(block_sizes_.back());
+        block = newBlock(size);
+    }
+    blocks_.push_back(block);
+    block_sizes_.push_back(size);
+    last_ = std::next(block, size - 1);
+    current_ = block;
+    refill();
 }
 
 template<typename T>
@@ -49,12 +511,7 @@ inline T* ObjectPool<T>::getPtrFromBuffer(void) {
         // progress, this function will return nullptr for other threads.  This is desired     
         // behaviour, because then alloc will continue looping and attempt to get another pointer.
         if (std::atomic_compare_exchange_strong<T*>(&current_, &tmplast, nullptr)) {
-            blocks_.push_back(next_.get());
-            next_ = std::async(std::launch::async, [](void) {
-                return new T[Cutter::Const::DEFAULT_BUFFER_SIZE];
-            });
-            last_ = std::next(blocks_.back(), Cutter::Const::DEFAULT_BUFFER_SIZE - 1);
-            current_ = blocks_.back();
+            swapBlock();
             return tmplast;
         }
         ptr = current_.load();
@@ -65,51 +522,474 @@ inline T* ObjectPool<T>::getPtrFromBuffer(void) {
     return ptr;
 }
 
-// CAVEAT EMPTOR: There is currently nothing to prevent bugs resulting from pointer reuse.  
 template<typename T>
-T* ObjectPool<T>::alloc(void) {
+inline typename ObjectPool<T>::Local* ObjectPool<T>::local(void) {
+    size_t id = ThreadSlot::id();
+    if (id == ThreadSlot::NONE)
+        return nullptr;
+    Local* local = locals_[id].load();
+    if (local == nullptr) {
+        local = new Local();
+        locals_[id] = local;
+    }
+    return local;
+}
+
+// Only the owner ever writes to a Local's tally, so it can skip the locked increment.
+template<typename T>
+inline void ObjectPool<T>::count(Local* local, std::atomic<size_t> Tally::* which) {
+    if (local == nullptr) {
+        (tally_.*which).fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    std::atomic<size_t>& counter = local->tally.*which;
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Take the most recently returned object from mag, going to the shared list for more when it runs dry.  Returns
+// nullptr if both are empty.
+template<typename T>
+inline T* ObjectPool<T>::take(Magazine* mag, Cutter::Lockfree::Stack<T*>& shared) {
+    if (mag == nullptr) {
+        auto maybe_ptr = shared.pop();
+        if (!maybe_ptr.has_value())
+            return nullptr;
+        shared_cached_.fetch_sub(1, std::memory_order_relaxed);
+        return *maybe_ptr;
+    }
+    if (mag->count == 0) {
+        // Refill half the magazine from the shared list in one go.
+        mag->count = shared.pop_bulk(mag->objs, MAGAZINE_SIZE / 2);
+        if (mag->count == 0)
+            return nullptr;
+        shared_cached_.fetch_sub(mag->count, std::memory_order_relaxed);
+        // pop_bulk hands back the most recently returned object first.  It should be the first to go back out.
+        std::reverse(mag->objs, mag->objs + mag->count);
+    }
+    return mag->objs[--mag->count];
+}
+
+template<typename T>
+inline void ObjectPool<T>::give(Magazine* mag, Cutter::Lockfree::Stack<T*>& shared, T* obj) {
+    if (mag != nullptr && mag->count < MAGAZINE_SIZE) {
+        mag->objs[mag->count++] = obj;
+        return;
+    }
+    ptrdiff_t spilled;
+    if (mag == nullptr) {
+        shared.push(obj);
+        spilled = 1;
+    }
+    else {
+        // Hand the older half back to the shared list, and keep the objects returned most recently.
+        shared.push_bulk(mag->objs, mag->objs + MAGAZINE_SIZE / 2);
+        std::move(mag->objs + MAGAZINE_SIZE / 2, mag->objs + MAGAZINE_SIZE, mag->objs);
+        mag->count = MAGAZINE_SIZE / 2;
+        mag->objs[mag->count++] = obj;
+        spilled = MAGAZINE_SIZE / 2;
+    }
+    size_t watermark = high_watermark_.load(std::memory_order_relaxed);
+    ptrdiff_t cached = shared_cached_.fetch_add(spilled, std::memory_order_relaxed) + spilled;
+    if (watermark == 0 || cached <= static_cast<ptrdiff_t>(watermark))
+        return;
+    // If somebody else is already trimming or swapping blocks, let them be.
+    std::unique_lock<std::mutex> lock(blocks_mtx_, std::try_to_lock);
+    if (lock.owns_lock())
+        trimLocked(watermark / 2);
+}
+
+template<typename T>
+T* ObjectPool<T>::allocShared(Local* local) {
     T* obj_ptr = nullptr;
     do {
         if (free_.empty()) {
             obj_ptr = getPtrFromBuffer();
+            if (obj_ptr != nullptr)
+                count(local, &Tally::fresh);
         }
         else {
             // It's possible that another thread took the last free ptr
             // before this thread got to it.  We just need to check that
             // the dequeue successfully returned an object from the list.
-            auto maybe_ptr = free_.dequeue();
-            if (maybe_ptr.has_value())
+            auto maybe_ptr = free_.pop();
+            if (maybe_ptr.has_value()) {
                 obj_ptr = *maybe_ptr;
+                shared_cached_.fetch_sub(1, std::memory_order_relaxed);
+                count(local, &Tally::reused);
+            }
         }
     } while (obj_ptr == nullptr);
     return obj_ptr;
 }
 
+// Storage for one object, with nothing constructed in it.  Fresh storage is still carved out of the block one
+// object at a time, so that the block is handed out in order and nothing is stranded in a magazine before
+// anybody has used it.
+template<typename T>
+T* ObjectPool<T>::allocRaw(Local* local) {
+    if (local != nullptr) {
+        T* obj_ptr = take(&local->freed, free_);
+        if (obj_ptr != nullptr) {
+            count(local, &Tally::reused);
+            return obj_ptr;
+        }
+    }
+    return allocShared(local);
+}
+
+// CAVEAT EMPTOR: There is nothing to prevent bugs resulting from pointer reuse.  Use a HandlePool if that matters.
+template<typename T>
+T* ObjectPool<T>::alloc(void) {
+    Local* local = this->local();
+    T* obj_ptr = take(local != nullptr ? &local->cleaned : nullptr, cleaned_);
+    if (obj_ptr != nullptr) {
+        count(local, &Tally::reused);
+        return obj_ptr;
+    }
+    return new (allocRaw(local)) T();
+}
+
 // Allocate and construct in place.
 template<typename T>
 template<typename... Args>
 T* ObjectPool<T>::alloc(Args&&... args) {
-    T* obj_ptr = alloc();
-    *obj_ptr = T(std::forward<Args>(args)...);
-    return obj_ptr;
+    return new (allocRaw(local())) T(std::forward<Args>(args)...);
 }
 
 template<typename T>
 void ObjectPool<T>::free(T* obj) {
     // Call the destructor for the object to avoid leaking memory
     obj->~T();
-    free_.enqueue(obj);
+    Local* local = this->local();
+    count(local, &Tally::returned);
+    give(local != nullptr ? &local->freed : nullptr, free_, obj);
     return;
 }
 
 template<typename T>
 void ObjectPool<T>::clean(T* obj) {
     // Free an object without calling the destructor.  
-    // This is useful when reusing protobuf objects.
-    // TODO: ADD A WIPE/CLEAN ASPECT TO THIS FUNCTION
-    free_.enqueue(obj);
+    // This is useful when reusing protobuf objects, which keep their memory when they're cleared.
+    Reset<T>::reset(*obj);
+    Local* local = this->local();
+    count(local, &Tally::returned);
+    give(local != nullptr ? &local->cleaned : nullptr, cleaned_, obj);
     return;
 }
 
+template<typename T>
+typename ObjectPool<T>::Stats ObjectPool<T>::stats(void) const {
+    size_t fresh = tally_.fresh.load(std::memory_order_relaxed);
+    size_t reused = tally_.reused.load(std::memory_order_relaxed);
+    size_t returned = tally_.returned.load(std::memory_order_relaxed);
+    for (auto& slot : locals_) {
+        const Local* local = slot.load();
+        if (local == nullptr) continue;
+        fresh += local->tally.fresh.load(std::memory_order_relaxed);
+        reused += local->tally.reused.load(std::memory_order_relaxed);
+        returned += local->tally.returned.load(std::memory_order_relaxed);
+    }
+    size_t capacity = 0;
+    {
+        std::lock_guard<std::mutex> lock(blocks_mtx_);
+        for (size_t size : block_sizes_) capacity += size;
+    }
+    // Each thread's counts can go "negative" on their own, but unsigned arithmetic wraps, so the totals come out
+    // right.
+    return Stats{
+        fresh + reused - returned,
+        returned - reused - trimmed_.load(std::memory_order_relaxed),
+        capacity
+    };
+}
+
+template<typename T>
+size_t ObjectPool<T>::trim(size_t keep) {
+    // The caller's own magazines are fair game.
+    if (Local* local = this->local()) {
+        free_.push_bulk(local->freed.objs, local->freed.objs + local->freed.count);
+        cleaned_.push_bulk(local->cleaned.objs, local->cleaned.objs + local->cleaned.count);
+        shared_cached_.fetch_add(local->freed.count + local->cleaned.count, std::memory_order_relaxed);
+        local->freed.count = 0;
+        local->cleaned.count = 0;
+    }
+    std::lock_guard<std::mutex> lock(blocks_mtx_);
+    return trimLocked(keep);
+}
+
+template<typename T>
+void ObjectPool<T>::setHighWatermark(size_t watermark) {
+    high_watermark_ = watermark;
+}
+
+// Empty the shared lists, count how many of each block's objects turned up, and release the blocks that got all
+// of theirs back.  Whatever isn't released goes back on the lists, in the order it came off (pop_bulk hands out
+// the top first, and push_bulk leaves its last element on top).
+template<typename T>
+size_t ObjectPool<T>::trimLocked(size_t keep) {
+    // The last block is the one being carved up, so it's never a candidate.
+    const size_t n_blocks = blocks_.size() - 1;
+    if (n_blocks == 0)
+        return 0;
+
+    auto drain = [] (Cutter::Lockfree::Stack<T*>& shared) {
+        std::vector<T*> objs;
+        T* batch[MAGAZINE_SIZE];
+        while (size_t n = shared.pop_bulk(batch, MAGAZINE_SIZE)) 
+            objs.insert(objs.end(), batch, batch + n);
+        return objs;
+    };
+    std::vector<T*> freed = drain(free_);
+    std::vector<T*> cleaned = drain(cleaned_);
+    size_t cached = freed.size() + cleaned.size();
+    shared_cached_.fetch_sub(cached, std::memory_order_relaxed);
+
+    // Sort the blocks by address so that each object's block can be found with a binary search.
+    std::vector<size_t> order(n_blocks);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this] (size_t a, size_t b) { 
+        return std::less<T*>()(blocks_[a], blocks_[b]); 
+    });
+    auto owner = [&] (T* obj) {
+        auto it = std::upper_bound(order.begin(), order.end(), obj, [this] (T* ptr, size_t i) { 
+            return std::less<T*>()(ptr, blocks_[i]); 
+        });
+        if (it == order.begin())
+            return n_blocks;
+        size_t i = *std::prev(it);
+        return std::less<T*>()(obj, std::next(blocks_[i], block_sizes_[i])) ? i : n_blocks;
+    };
+    std::vector<size_t> held(n_blocks + 1, 0);
+    for (T* obj : freed) ++held[owner(obj)];
+    for (T* obj : cleaned) ++held[owner(obj)];
+
+    std::vector<bool> release(n_blocks + 1, false);
+    size_t released = 0;
+    for (size_t i = 0; i < n_blocks && cached > keep; ++i) {
+        if (held[i] != block_sizes_[i])
+            continue;
+        release[i] = true;
+        released += block_sizes_[i];
+        cached -= block_sizes_[i];
+    }
+    if (released == 0) {
+        free_.push_bulk(freed.rbegin(), freed.rend());
+        cleaned_.push_bulk(cleaned.rbegin(), cleaned.rend());
+        shared_cached_.fetch_add(freed.size() + cleaned.size(), std::memory_order_relaxed);
+        return 0;
+    }
+
+    auto keepers = [&] (std::vector<T*>& objs, bool destroy) {
+        auto end = std::remove_if(objs.begin(), objs.end(), [&] (T* obj) {
+            if (!release[owner(obj)])
+                return false;
+            if (destroy) obj->~T();
+            return true;
+        });
+        objs.erase(end, objs.end());
+        return objs.size();
+    };
+    size_t kept = keepers(freed, false) + keepers(cleaned, true);
+    free_.push_bulk(freed.rbegin(), freed.rend());
+    cleaned_.push_bulk(cleaned.rbegin(), cleaned.rend());
+    shared_cached_.fetch_add(kept, std::memory_order_relaxed);
+    trimmed_.fetch_add(released, std::memory_order_relaxed);
+
+    size_t j = 0;
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        if (release[i]) {
+            deleteBlock(blocks_[i], block_sizes_[i]);
+            continue;
+        }
+        blocks_[j] = blocks_[i];
+        block_sizes_[j] = block_sizes_[i];
+        ++j;
+    }
+    blocks_.resize(j);
+    block_sizes_.resize(j);
+    return released;
+}
+/********* START NUMA OBJECT POOL *********/
+
+template<typename T>
+NumaObjectPool<T>::NumaObjectPool(
+    size_t block_size, 
+    Growth growth, 
+    size_t max_block_size, 
+    size_t prealloc, 
+    size_t reserve,
+    Pages pages
+):
+    arenas_(),
+    pools_()
+{
+    for (size_t node = 0; node < Numa::nodes(); ++node) {
+        arenas_.push_back(std::make_unique<Arena>(reserve, node, pages));
+        pools_.push_back(std::make_unique<ObjectPool<T>>(
+            block_size, growth, max_block_size, prealloc, arenas_.back().get()
+        ));
+    }
+}
+
+template<typename T>
+inline ObjectPool<T>& NumaObjectPool<T>::local(void) {
+    return *pools_[std::min(Numa::node(), pools_.size() - 1)];
+}
+
+// There are only ever a handful of nodes, so a linear search over the arenas is as quick as anything.
+template<typename T>
+inline ObjectPool<T>& NumaObjectPool<T>::home(const T* obj) {
+    for (size_t node = 1; node < arenas_.size(); ++node) {
+        if (arenas_[node]->owns(obj))
+            return *pools_[node];
+    }
+    return *pools_[0];
+}
+
+template<typename T>
+T* NumaObjectPool<T>::alloc(void) {
+    return local().alloc();
+}
+
+template<typename T>
+template<typename... Args>
+T* NumaObjectPool<T>::alloc(Args&&... args) {
+    return local().alloc(std::forward<Args>(args)...);
+}
+
+template<typename T>
+void NumaObjectPool<T>::free(T* obj) {
+    home(obj).free(obj);
+}
+
+template<typename T>
+void NumaObjectPool<T>::clean(T* obj) {
+    home(obj).clean(obj);
+}
+
+template<typename T>
+typename ObjectPool<T>::Stats NumaObjectPool<T>::stats(void) const {
+    typename ObjectPool<T>::Stats total{0, 0, 0};
+    for (auto& pool : pools_) {
+        auto stats = pool->stats();
+        total.live += stats.live;
+        total.cached += stats.cached;
+        total.capacity += stats.capacity;
+    }
+    return total;
+}
+
+template<typename T>
+size_t NumaObjectPool<T>::trim(size_t keep) {
+    size_t released = 0;
+    for (auto& pool : pools_) 
+        released += pool->trim(keep);
+    return released;
+}
+
+/********* START HANDLE POOL *********/
+
+template<typename T>
+Handle<T>::Handle(void): word_(0) {}
+
+template<typename T>
+Handle<T>::Handle(void* slot, uint16_t generation): 
+    word_((Cutter::Lockfree::Tagged(generation) << Cutter::Lockfree::TAG_SHIFT) | reinterpret_cast<Cutter::Lockfree::Tagged>(slot))
+{}
+
+template<typename T>
+Handle<T>::operator bool(void) const {
+    return word_ != 0;
+}
+
+template<typename T>
+bool Handle<T>::operator== (const Handle& other) const {
+    return word_ == other.word_;
+}
+
+template<typename T>
+bool Handle<T>::operator!= (const Handle& other) const {
+    return word_ != other.word_;
+}
+
+template<typename T>
+HandlePool<T>::Entry::Entry(void): generation(std::atomic<uint16_t>(0)) {}
+
+// Whoever releases the slot destroys the value.
+template<typename T>
+HandlePool<T>::Entry::~Entry(void) {}
+
+template<typename T>
+HandlePool<T>::HandlePool(
+    size_t block_size, 
+    Growth growth, 
+    size_t max_block_size, 
+    size_t prealloc, 
+    Arena* arena, 
+    bool poison
+):
+    pool_(block_size, growth, max_block_size, prealloc, arena),
+    poison_(poison)
+{}
+
+// Skips 0, which is kept for slots that have never been released.
+template<typename T>
+inline uint16_t HandlePool<T>::next(uint16_t generation) {
+    uint16_t next = generation + 1;
+    return next == 0 ? 1 : next;
+}
+
+template<typename T>
+inline bool HandlePool<T>::poisoned(const Entry* entry) const {
+    auto bytes = reinterpret_cast<const unsigned char*>(&entry->value);
+    return std::all_of(bytes, bytes + sizeof(T), [] (unsigned char b) { return b == POISON; });
+}
+
+template<typename T>
+template<typename... Args>
+Handle<T> HandlePool<T>::alloc(Args&&... args) {
+    Entry* entry = pool_.alloc();
+    uint16_t generation = entry->generation.load(std::memory_order_relaxed);
+    if (poison_ && generation != 0 && !poisoned(entry)) {
+        // Put it back the way it should be, so that the slot isn't lost.
+        std::memset(static_cast<void*>(&entry->value), POISON, sizeof(T));
+        pool_.clean(entry);
+        throw std::logic_error("HandlePool: a released object was written to through a stale pointer");
+    }
+    new (&entry->value) T(std::forward<Args>(args)...);
+    return Handle<T>(entry, generation);
+}
+
+template<typename T>
+T* HandlePool<T>::get(Handle<T> handle) const {
+    Entry* entry = Cutter::Lockfree::untag<Entry>(handle.word_);
+    if (entry == nullptr)
+        return nullptr;
+    uint16_t generation = handle.word_ >> Cutter::Lockfree::TAG_SHIFT;
+    return entry->generation.load(std::memory_order_acquire) == generation ? &entry->value : nullptr;
+}
+
+template<typename T>
+bool HandlePool<T>::free(Handle<T> handle) {
+    Entry* entry = Cutter::Lockfree::untag<Entry>(handle.word_);
+    if (entry == nullptr)
+        return false;
+    // Moving the generation on first means that only one of two racing frees gets to destroy the object, and
+    // that nobody can get() it once it's being destroyed.
+    uint16_t generation = handle.word_ >> Cutter::Lockfree::TAG_SHIFT;
+    if (!entry->generation.compare_exchange_strong(generation, next(generation)))
+        return false;
+    entry->value.~T();
+    if (poison_) 
+        std::memset(static_cast<void*>(&entry->value), POISON, sizeof(T));
+    pool_.clean(entry);
+    return true;
+}
+
+template<typename T>
+typename ObjectPool<typename HandlePool<T>::Entry>::Stats HandlePool<T>::stats(void) const {
+    return pool_.stats();
+}
+
 }
 }
@@ -2,8 +2,15 @@
 #define MEMORY_HPP 
 
 #include <atomic>
-#include <future>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include <gtest/gtest_prod.h>
@@ -14,31 +21,413 @@
 namespace Cutter {
 namespace Memory {
 
+// Number of free objects a thread can hold on to in its magazine.  Half a magazine is moved to or from the shared
+// free list at a time.
+constexpr size_t MAGAZINE_SIZE = 64;
+// Threads beyond this many alive at once go straight to the shared free list.
+constexpr size_t MAX_THREAD_SLOTS = 256;
+// Default cap on the number of objects in a block when blocks grow geometrically.
+constexpr size_t MAX_BLOCK_SIZE = 1 << 20;
+// Default amount of address space an Arena reserves at a time.  None of it is backed by memory until it's touched.
+constexpr size_t ARENA_RESERVE = size_t(1) << 30;
+// How many times an Arena can reserve more address space.
+constexpr size_t MAX_ARENA_REGIONS = 64;
+// Default amount of address space the NodeArena reserves for the nodes of every lock free container.
+constexpr size_t NODE_ARENA_RESERVE = size_t(1) << 30;
+// Used when the kernel won't say how big its huge pages are.
+constexpr size_t DEFAULT_HUGE_PAGE_SIZE = size_t(2) << 20;
+
+// How the size of each new block is chosen.  Fixed blocks are all the size the pool was constructed with.
+// Geometric blocks double each time, up to the pool's cap, so a pool that turns out to be busy makes fewer
+// and fewer trips to the allocator.
+enum class Growth { Fixed, Geometric };
+
+// Hands out small integer ids to live threads, so that per-thread state can live in a flat array instead of a
+// map.  Ids are recycled when a thread exits, and the next thread to get the id inherits whatever was left in
+// its slot.
+class ThreadSlot {
+private:
+    struct Holder {
+        size_t id;
+        Holder(void);
+        ~Holder(void);
+    };
+    static inline std::mutex mtx_;
+    static inline std::vector<size_t> free_;
+    static inline size_t next_ = 0;
+public:
+    static constexpr size_t NONE = MAX_THREAD_SLOTS;
+    static size_t id(void);
+};
+
+// What little of the machine's NUMA layout the pools need, read from sysfs and set with raw syscalls so that
+// there's no dependency on libnuma.  On a single node machine, or if sysfs can't be read, everything is node 0
+// and bind does nothing.
+class Numa {
+private:
+    // MPOL_PREFERRED from <numaif.h>.  Preferred rather than bound, so that a full node spills over instead of
+    // failing the allocation.
+    static constexpr int PREFERRED_POLICY = 1;
+    static const std::vector<size_t>& cpuNodes(void);
+public:
+    static constexpr size_t ANY = SIZE_MAX;
+    static size_t nodes(void);
+    // The node of the CPU the calling thread is running on right now.
+    static size_t node(void);
+    // Ask for the pages of [addr, addr + bytes) to be placed on node when they're first touched.
+    static void bind(void* addr, size_t bytes, size_t node);
+};
+
+// Whether HandlePools poison released objects unless told otherwise.  On in debug builds.
+#ifdef NDEBUG
+constexpr bool POISON_FREED = false;
+#else
+constexpr bool POISON_FREED = true;
+#endif
+
+// What an Arena's memory is made of.  Huge is explicitly reserved huge pages (MAP_HUGETLB), which only exist if
+// the administrator has set some aside.  Transparent is ordinary memory that the kernel is asked to back with huge
+// pages where it can (MADV_HUGEPAGE).  Either way, one TLB entry covers a whole huge page instead of 4K.
+enum class Pages { Normal, Transparent, Huge };
+
+// Stretches of address space reserved a region at a time, which pools carve their blocks out of.  Pages are only
+// backed by memory once they're touched, and a released block gives its pages back to the OS while keeping its
+// addresses for the next block that fits.  Released ranges are not merged.  When a region runs out, the arena
+// reserves another of the same size, or bigger if that's what the block needs, so that no one reservation has to
+// be big enough for everything.
+//
+// An arena asked for Huge pages that the kernel can't reserve falls back on Transparent ones, and an arena asked
+// for Transparent pages falls back on Normal ones if transparent huge pages are switched off.  pages() says what
+// it actually got.  Unlike the others, Huge pages are committed as soon as a region is reserved, so keep the
+// reservation to what will really be used.
+class Arena {
+private:
+    struct Region {
+        char* base;
+        size_t size;
+    };
+
+    std::mutex mtx_;
+    // Only ever appended to, and n_regions_ is bumped after, so owns() can read them without the lock.
+    Region regions_[MAX_ARENA_REGIONS];
+    std::atomic<size_t> n_regions_;
+    size_t used_;                               // Of the newest region
+    size_t reserve_;                            // How much each region reserves
+    size_t node_;
+    std::multimap<size_t, char*> released_;     // Keyed by size
+    Pages pages_;
+    size_t granule_;                            // Everything is handed out in multiples of this
+    static size_t pageSize(void);
+    static char* map(size_t bytes, size_t align, int flags);
+    size_t roundUp(size_t bytes) const;
+    void add(char* base, size_t size);
+    void grow(size_t bytes);
+public:
+    explicit Arena(size_t reserve = ARENA_RESERVE, size_t node = Numa::ANY, Pages pages = Pages::Normal);
+    ~Arena(void);
+    Arena(const Arena&) = delete;
+    Arena& operator= (const Arena&) = delete;
+
+    static size_t hugePageSize(void);
+    // Aligned to granule().  Throws std::bad_alloc if the arena needs another region and can't reserve one.
+    void* allocate(size_t bytes);
+    void deallocate(void* ptr, size_t bytes);
+    bool owns(const void* ptr) const;
+    Pages pages(void) const;
+    // The page size, or the huge page size if the arena was asked for huge pages.  Blocks that are a multiple
+    // of this waste nothing.
+    size_t granule(void) const;
+};
+
+// Gives the nodes of every Lockfree::Queue and Lockfree::Stack in the process a home in an arena, instead of
+// scattering them over the heap 64 at a time.  Node blocks are packed into whole granules of the arena, so with
+// huge pages a few TLB entries cover millions of nodes.  The arena is never unmapped, since node blocks live
+// until the program exits.
+class NodeArena {
+private:
+    std::mutex mtx_;
+    Arena arena_;
+    char* next_;
+    char* end_;
+    static inline std::atomic<NodeArena*> instance_{nullptr};
+    NodeArena(Pages pages, size_t reserve);
+    static void* allocate(size_t bytes, size_t align) noexcept;
+public:
+    // Blocks allocated from here on come from the arena, and blocks allocated already stay where they are.  Only
+    // the first call makes an arena.  Returns the pages the arena got.
+    static Pages install(Pages pages = Pages::Huge, size_t reserve = NODE_ARENA_RESERVE);
+    static bool owns(const void* ptr);
+};
+
+// A single background thread that allocates blocks ahead of time for every pool in the process, so that a block
+// swap neither waits on the allocator nor pays for starting a thread of its own.  It sleeps while there's
+// nothing to do.
+class Refiller {
+private:
+    Cutter::Lockfree::Queue<std::function<void()>> jobs_;
+    std::atomic<bool> stopped_;
+    std::thread worker_;
+    Refiller(void);
+public:
+    ~Refiller(void);
+    Refiller(const Refiller&) = delete;
+    Refiller& operator= (const Refiller&) = delete;
+
+    static Refiller& instance(void);
+    void submit(std::function<void()>);
+};
+
+template<typename T, typename = void>
+struct has_Clear: std::false_type {};
+
+template<typename T>
+struct has_Clear<T, std::void_t< decltype(std::declval<T&>().Clear()) >>: std::true_type {};
+
+template<typename T, typename = void>
+struct has_clear: std::false_type {};
+
+template<typename T>
+struct has_clear<T, std::void_t< decltype(std::declval<T&>().clear()) >>: std::true_type {};
+
+// How ObjectPool::clean wipes an object before it's handed out again.  Protobuf messages, or anything else with a
+// Clear() method, are Clear()ed, which empties them but keeps whatever their repeated and string fields have
+// already allocated.  Failing that, anything with a clear() method (the standard containers, say) is clear()ed
+// for the same reason.  Anything else is left as it is.  Specialize this for types that need something else.
+template<typename T>
+struct Reset {
+    static void reset(T& obj);
+};
+
 template<typename T>
 class ObjectPool {
 private:
     FRIEND_TEST(ObjectPoolTest, BlockSwap);
     FRIEND_TEST(ObjectPoolTest, MultithreadedAllocFromOneBuffer);
     FRIEND_TEST(ObjectPoolTest, MultithreadedAllocMultiBuffer);
+    FRIEND_TEST(ObjectPoolTest, FreedObjectsStayWithTheThread);
+    FRIEND_TEST(ObjectPoolTest, GeometricGrowthIsCapped);
+    FRIEND_TEST(ObjectPoolTest, PreallocatedBlocksAreUsedFirst);
+    FRIEND_TEST(ObjectPoolTest, TrimReleasesOnlyEmptyBlocks);
+    FRIEND_TEST(ObjectPoolTest, HighWatermarkTrimsOnFree);
+    FRIEND_TEST(ObjectPoolTest, BlocksComeFromTheArena);
+
+    // A thread's private stack of free objects.  The usual alloc/free pair only touches the calling thread's
+    // magazine; the shared free list is only visited half a magazine at a time.
+    struct alignas(Cutter::Const::CACHE_LINE_SIZE) Magazine {
+        size_t count;
+        T* objs[MAGAZINE_SIZE];
+        Magazine(void);
+    };
 
+    // Running counts of what a thread has done with the pool.  A thread can free objects that another one
+    // allocated, so only the sums across all threads mean anything.
+    struct Tally {
+        std::atomic<size_t> fresh;      // Carved out of a block
+        std::atomic<size_t> reused;     // Taken from a magazine or a shared list
+        std::atomic<size_t> returned;   // Handed back through free or clean
+        Tally(void);
+    };
+
+    struct Local {
+        Magazine freed;
+        Magazine cleaned;
+        Tally tally;
+    };
+
+    // Blocks are raw storage.  Nothing is constructed in a slot until it's handed out.
+    struct alignas(T) Slot {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    // Where blocks come from.  nullptr means the heap.
+    Arena* const arena_;
     std::vector<T*> blocks_;
     alignas(64) std::atomic<T*> current_;
     char pad[Cutter::Const::CACHE_LINE_SIZE - sizeof(std::atomic<T*>)];
     
     T* last_;
-    std::future<T*> next_;
-    Cutter::Lockfree::Queue<T*> free_;
+    // Everything from here down to free_ is only touched by whichever thread is swapping blocks (or by the
+    // refill it schedules, through next_ and refilling_).  blocks_ and block_sizes_ are also changed by trim,
+    // so both hold blocks_mtx_ while they work.
+    mutable std::mutex blocks_mtx_;
+    std::vector<size_t> block_sizes_;
+    const size_t block_size_;
+    const Growth growth_;
+    const size_t max_block_size_;
+    std::vector<std::pair<T*, size_t>> spare_;  // Preallocated blocks, used before next_
+    std::atomic<T*> next_;                      // Block prepared by the refiller, nullptr until it lands
+    size_t next_size_;
+    std::atomic<bool> refilling_;
+    // Storage of destroyed objects.
+    Cutter::Lockfree::Stack<T*> free_;
+    // Objects handed back through clean(), which are still constructed.
+    Cutter::Lockfree::Stack<T*> cleaned_;
+    // Roughly how many objects are sitting on free_ and cleaned_.  It's only updated when objects move to or from
+    // those lists, which is at most once per half magazine for most threads.
+    std::atomic<ptrdiff_t> shared_cached_;
+    // Once shared_cached_ passes this, the thread that pushed it over trims the pool.  Zero means never.
+    std::atomic<size_t> high_watermark_;
+    std::atomic<size_t> trimmed_;
+    // Counts for threads that didn't get a slot.
+    Tally tally_;
+    // Indexed by ThreadSlot::id().  Each entry is created and used only by the thread holding that id, though
+    // stats reads the tallies of all of them.
+    std::atomic<Local*> locals_[MAX_THREAD_SLOTS];
 
     inline T* getPtrFromBuffer(void);
     inline bool noFreePtrsAvail(void);
+    inline T* newBlock(size_t size);
+    inline void deleteBlock(T* block, size_t size);
+    inline size_t nextBlockSize(size_t after);
+    void swapBlock(void);
+    void refill(void);
+    inline Local* local(void);
+    inline void count(Local* local, std::atomic<size_t> Tally::* which);
+    inline T* take(Magazine* mag, Cutter::Lockfree::Stack<T*>& shared);
+    inline void give(Magazine* mag, Cutter::Lockfree::Stack<T*>& shared, T* obj);
+    T* allocShared(Local* local);
+    T* allocRaw(Local* local);
+    size_t trimLocked(size_t keep);
 
 public:
-    ObjectPool(void);
+    // prealloc objects' worth of blocks are allocated up front, so that the pool doesn't need to grow until
+    // more than that many objects are out at once.  If an arena is given, blocks are carved out of it instead of
+    // the heap, and it has to outlive the pool.  Blocks are rounded up to the arena's granule, so with huge pages
+    // block sizes should fill a whole number of them.
+    ObjectPool(
+        size_t block_size = Cutter::Const::DEFAULT_BUFFER_SIZE, 
+        Growth growth = Growth::Fixed, 
+        size_t max_block_size = MAX_BLOCK_SIZE,
+        size_t prealloc = 0,
+        Arena* arena = nullptr
+    );
+    // Objects that are still out when the pool goes away are not destroyed.
     ~ObjectPool(void);
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator= (const ObjectPool&) = delete;
+    // Hands back an object that was returned through clean() if there is one, or else default constructs one.
+    // Either way it's as good as new, so long as Reset<T> does its job.
     T* alloc(void);
+    // Always constructs a new object from args.  T need not be default constructible to use this.
     template<typename... Args> T* alloc(Args&&...);
+    // Destroys the object and keeps its storage.
     void free(T* obj);
+    // Wipes the object with Reset<T> and keeps it, for a later alloc(void) to reuse.
     void clean(T* obj);
+
+    struct Stats {
+        size_t live;        // Allocated and not yet handed back
+        size_t cached;      // Handed back and held for reuse, whether freed or cleaned
+        size_t capacity;    // Objects' worth of storage in blocks that have been put into use
+    };
+    // A snapshot, which may be slightly stale while other threads are busy with the pool.
+    Stats stats(void) const;
+    // Release blocks whose objects have all been handed back, until no more than keep objects are left on the
+    // shared lists.  The calling thread's magazines are emptied first.  The block currently being carved up is
+    // always kept, and objects sitting in other threads' magazines keep their blocks alive.  Returns the number of objects' worth of storage released.
+    size_t trim(size_t keep = 0);
+    // Trim automatically, down to half of watermark, whenever more than watermark objects pile up on the shared
+    // lists.  Zero turns this off.
+    void setHighWatermark(size_t watermark);
+};
+
+// An ObjectPool per NUMA node, each with its own arena bound to that node.  Threads allocate from the pool of the
+// node they're running on, and objects always go back to the pool they came from, wherever they're freed, so a
+// pipeline that allocates on one socket and frees on the other doesn't drain one pool into the other.  On a
+// single node machine this is one pool and one arena.
+template<typename T>
+class NumaObjectPool {
+private:
+    FRIEND_TEST(ObjectPoolTest, NumaPoolSendsObjectsHome);
+
+    std::vector<std::unique_ptr<Arena>> arenas_;
+    std::vector<std::unique_ptr<ObjectPool<T>>> pools_;
+
+    inline ObjectPool<T>& local(void);
+    inline ObjectPool<T>& home(const T* obj);
+public:
+    // The arguments are as for ObjectPool and Arena, and apply to each node's pool.
+    NumaObjectPool(
+        size_t block_size = Cutter::Const::DEFAULT_BUFFER_SIZE, 
+        Growth growth = Growth::Fixed, 
+        size_t max_block_size = MAX_BLOCK_SIZE,
+        size_t prealloc = 0,
+        size_t reserve = ARENA_RESERVE,
+        Pages pages = Pages::Normal
+    );
+    T* alloc(void);
+    template<typename... Args> T* alloc(Args&&...);
+    void free(T* obj);
+    void clean(T* obj);
+    // Summed over the nodes.
+    typename ObjectPool<T>::Stats stats(void) const;
+    // Trims each node's pool down to keep.
+    size_t trim(size_t keep = 0);
+};
+
+// A reference to an object in a HandlePool.  It's a tagged pointer: the address of the object's slot, and above
+// it the generation the slot was in when the object was allocated.  Every release moves the slot on to the next
+// generation, so a handle that outlived its object no longer matches.  Generations are 16 bits, so a handle that
+// sits around while its slot is reused 65535 times comes back to life.
+template<typename T>
+class Handle {
+private:
+    Cutter::Lockfree::Tagged word_;
+    template<typename> friend class HandlePool;
+    Handle(void* slot, uint16_t generation);
+public:
+    // Refers to nothing.
+    Handle(void);
+    explicit operator bool(void) const;
+    bool operator== (const Handle&) const;
+    bool operator!= (const Handle&) const;
+};
+
+// An ObjectPool that hands out Handles instead of pointers, so that reusing objects aggressively can't turn a
+// dangling reference into a silent read of somebody else's record.  get() checks the handle's generation against
+// its slot's, which is one load.  A slot's storage is never given back while the pool is alive (there's no trim),
+// which is what makes it safe to look at a slot through a stale handle.
+//
+// With poisoning on, released objects are overwritten with a pattern, so reads through a stale raw pointer see
+// garbage rather than plausible data, and a slot whose pattern has been disturbed by the time it's reused makes
+// alloc throw std::logic_error.
+template<typename T>
+class HandlePool {
+private:
+    static constexpr unsigned char POISON = 0xDB;
+
+    // Entries are only ever cleaned, never freed, so a slot's generation survives from one object to the next.
+    // Generation 0 is a slot that has never been released.
+    struct Entry {
+        std::atomic<uint16_t> generation;
+        union { T value; };
+        Entry(void);
+        ~Entry(void);
+    };
+
+    ObjectPool<Entry> pool_;
+    const bool poison_;
+
+    static inline uint16_t next(uint16_t generation);
+    inline bool poisoned(const Entry* entry) const;
+public:
+    // The first five arguments are as for ObjectPool.
+    HandlePool(
+        size_t block_size = Cutter::Const::DEFAULT_BUFFER_SIZE, 
+        Growth growth = Growth::Fixed, 
+        size_t max_block_size = MAX_BLOCK_SIZE,
+        size_t prealloc = 0,
+        Arena* arena = nullptr,
+        bool poison = POISON_FREED
+    );
+    template<typename... Args> Handle<T> alloc(Args&&...);
+    // nullptr if the handle's object has been released.  Nothing stops another thread from releasing it while
+    // the caller is still using the pointer, so handles shared between threads need some other agreement on who
+    // releases them.
+    T* get(Handle<T> handle) const;
+    // Destroys the object.  Returns false, and does nothing, if it's already been released.
+    bool free(Handle<T> handle);
+    typename ObjectPool<Entry>::Stats stats(void) const;
 };
 
 }
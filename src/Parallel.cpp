@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Proletariat.hpp"
+#include "Constants.hpp"
+
+namespace Cutter {
+namespace Proletariat {
+
+// Runs of fewer elements than this are sorted by a single thread.
+constexpr size_t MIN_SORT_RUN = 1 << 12;
+
+namespace detail {
+
+inline Loop::Loop(size_t n, size_t grain, size_t participants):
+    next_(std::atomic<size_t>(0)),
+    done_(std::atomic<size_t>(0)),
+    n_(n),
+    grain_(grain),
+    participants_(participants),
+    mtx_(),
+    error_()
+{}
+
+// Guided self-scheduling: a chunk is a share of whatever is left, but never less than the grain.
+inline bool Loop::claim(size_t& begin, size_t& end) {
+    begin = next_.load(std::memory_order_relaxed);
+    do {
+        if (begin >= n_)
+            return false;
+        size_t remaining = n_ - begin;
+        end = begin + std::min(remaining, std::max(grain_, remaining / (4 * participants_)));
+    } while (!next_.compare_exchange_weak(begin, end, std::memory_order_relaxed));
+    return true;
+}
+
+inline void Loop::finish(size_t begin, size_t end, std::exception_ptr error) {
+    if (error) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (!error_) error_ = error;
+    }
+    done_.fetch_add(end - begin, std::memory_order_release);
+}
+
+// Everything has been claimed by the time the caller gets here, so this only waits on chunks other threads are
+// still in the middle of.  Those may be stuck behind tasks queued on the helpers' lanes, so rather than just
+// yielding the caller runs whatever it can find, as TaskGroup::wait does.
+inline void Loop::wait(Pool& pool) {
+    while (done_.load(std::memory_order_acquire) < n_) {
+        if (!pool.help()) 
+            std::this_thread::yield();
+    }
+    if (error_)
+        std::rethrow_exception(error_);
+}
+
+inline size_t participants(const Pool& pool, size_t n, size_t grain) {
+    if (!pool.started())
+        return 1;
+    size_t chunks = (n + grain - 1) / grain;
+    return std::max<size_t>(1, std::min(static_cast<size_t>(pool.size) + 1, chunks));
+}
+
+template<typename Body>
+void forChunks(Pool& pool, size_t n, size_t grain, size_t k, Body& body) {
+    if (n == 0)
+        return;
+    auto loop = std::make_shared<Loop>(n, grain, k);
+    auto work = [loop, &body] (size_t slot) {
+        size_t begin, end;
+        while (loop->claim(begin, end)) {
+            std::exception_ptr error;
+            try {
+                body(begin, end, slot);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            loop->finish(begin, end, error);
+        }
+    };
+    for (size_t slot = 1; slot < k; ++slot) 
+        pool.post(work, slot);
+    work(0);
+    loop->wait(pool);
+}
+
+}
+
+template<typename Index, typename F>
+void parallel_for(Pool& pool, Index first, Index last, size_t grain, F&& f) {
+    if (!(first < last))
+        return;
+    auto body = [&] (size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; ++i) 
+            f(static_cast<Index>(first + i));
+    };
+    size_t n = static_cast<size_t>(last - first);
+    grain = std::max<size_t>(grain, 1);
+    detail::forChunks(pool, n, grain, detail::participants(pool, n, grain), body);
+}
+
+template<typename Index, typename T, typename Map, typename Reduce>
+T parallel_reduce(Pool& pool, Index first, Index last, size_t grain, T identity, Map&& map, Reduce&& reduce) {
+    if (!(first < last))
+        return identity;
+    size_t n = static_cast<size_t>(last - first);
+    grain = std::max<size_t>(grain, 1);
+
+    // One per participant, each on its own cache line.  A participant only ever touches its own.
+    struct alignas(Cutter::Const::CACHE_LINE_SIZE) Partial {
+        std::optional<T> value;
+    };
+    size_t k = detail::participants(pool, n, grain);
+    std::vector<Partial> partials(k);
+    auto body = [&] (size_t begin, size_t end, size_t slot) {
+        std::optional<T>& partial = partials[slot].value;
+        T acc = partial.has_value() ? std::move(*partial) : identity;
+        for (size_t i = begin; i < end; ++i) 
+            acc = reduce(std::move(acc), map(static_cast<Index>(first + i)));
+        partial = std::move(acc);
+    };
+    detail::forChunks(pool, n, grain, k, body);
+
+    T result = std::move(identity);
+    for (auto& partial : partials) {
+        if (partial.value.has_value())
+            result = reduce(std::move(result), std::move(*partial.value));
+    }
+    return result;
+}
+
+template<typename InputIt, typename OutputIt, typename F>
+OutputIt parallel_transform(Pool& pool, InputIt first, InputIt last, OutputIt out, size_t grain, F&& f) {
+    auto n = std::distance(first, last);
+    parallel_for(pool, decltype(n)(0), n, grain, [&] (decltype(n) i) { 
+        out[i] = f(first[i]); 
+    });
+    return std::next(out, n);
+}
+
+template<typename RandomIt, typename Compare>
+void parallel_sort(Pool& pool, RandomIt first, RandomIt last, Compare comp, bool stable) {
+    using value_type = typename std::iterator_traits<RandomIt>::value_type;
+    size_t n = static_cast<size_t>(std::distance(first, last));
+    size_t runs = detail::participants(pool, n, MIN_SORT_RUN);
+    if (runs == 1) {
+        stable ? std::stable_sort(first, last, comp) : std::sort(first, last, comp);
+        return;
+    }
+
+    std::vector<size_t> bounds(runs + 1);
+    for (size_t j = 0; j <= runs; ++j) 
+        bounds[j] = n * j / runs;
+    // One participant per run, as already worked out, rather than asking the pool again.
+    auto sortRuns = [&] (size_t begin, size_t end, size_t) {
+        for (size_t j = begin; j < end; ++j) {
+            RandomIt lo = std::next(first, bounds[j]), hi = std::next(first, bounds[j + 1]);
+            stable ? std::stable_sort(lo, hi, comp) : std::sort(lo, hi, comp);
+        }
+    };
+    detail::forChunks(pool, runs, 1, runs, sortRuns);
+
+    // Merge neighbouring runs back and forth between the range and a buffer, halving the number of runs each
+    // time.  std::merge takes from the left run on ties, so stable runs make a stable result.
+    std::vector<value_type> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+    auto round = [&] (auto src, auto dst) {
+        size_t n_runs = bounds.size() - 1;
+        parallel_for(pool, size_t(0), (n_runs + 1) / 2, 1, [&] (size_t j) {
+            size_t lo = bounds[2 * j];
+            size_t mid = bounds[std::min(2 * j + 1, n_runs)];
+            size_t hi = bounds[std::min(2 * j + 2, n_runs)];
+            std::merge(
+                std::make_move_iterator(std::next(src, lo)), std::make_move_iterator(std::next(src, mid)),
+                std::make_move_iterator(std::next(src, mid)), std::make_move_iterator(std::next(src, hi)),
+                std::next(dst, lo), 
+                comp
+            );
+        });
+        std::vector<size_t> merged;
+        for (size_t j = 0; j < bounds.size(); j += 2) 
+            merged.push_back(bounds[j]);
+        if (merged.back() != n) 
+            merged.push_back(n);
+        bounds.swap(merged);
+    };
+    // The sorted runs were moved into the buffer when it was made.
+    bool in_buffer = true;
+    while (bounds.size() > 2) {
+        if (in_buffer) 
+            round(buffer.begin(), first);
+        else 
+            round(first, buffer.begin());
+        in_buffer = !in_buffer;
+    }
+    if (in_buffer) {
+        parallel_for(pool, size_t(0), n, MIN_SORT_RUN, [&] (size_t i) { 
+            first[i] = std::move(buffer[i]); 
+        });
+    }
+}
+
+}
+}
@@ -0,0 +1,80 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+
+#include "Proletariat.hpp"
+#include "Constants.hpp"
+
+namespace Cutter {
+namespace Proletariat {
+
+// Fork-join loops on top of a Pool.  The calling thread always takes part, so these can be called from inside a
+// task running on the same pool without deadlocking, and they still finish (on the caller alone) when every
+// worker is busy.  Work is handed out in chunks of at least grain iterations, taken from a shared counter.  Early
+// chunks are large and they shrink towards grain as the range runs out, so there are few trips to the counter
+// while there's plenty left, and nobody is left holding a big chunk at the end.  If an iteration throws, the
+// exception is rethrown in the caller once every chunk that was started has finished.
+
+namespace detail {
+
+// What the participants in one loop share.  Helpers that only get to run after the loop is over find nothing
+// left to do and never touch the body, which by then may be gone.
+class Loop {
+private:
+    alignas(Cutter::Const::CACHE_LINE_SIZE) std::atomic<size_t> next_;
+    alignas(Cutter::Const::CACHE_LINE_SIZE) std::atomic<size_t> done_;
+    const size_t n_;
+    const size_t grain_;
+    const size_t participants_;
+    std::mutex mtx_;
+    std::exception_ptr error_;
+public:
+    Loop(size_t n, size_t grain, size_t participants);
+    // Claims the next chunk.  False once there's none left.
+    bool claim(size_t& begin, size_t& end);
+    void finish(size_t begin, size_t end, std::exception_ptr error);
+    // Runs other tasks from pool while it waits.
+    void wait(Pool& pool);
+};
+
+// Run body(begin, end, slot) over chunks of [0, n), where slot is 0 for the calling thread and 1 to k - 1 for the
+// helpers.  Callers that keep something per slot size it by the same k they pass in, normally
+// participants(pool, n, grain) worked out once, since the pool can stop in between two calls.
+template<typename Body>
+void forChunks(Pool& pool, size_t n, size_t grain, size_t k, Body& body);
+
+size_t participants(const Pool& pool, size_t n, size_t grain);
+
+}
+
+// f(i) for every i in [first, last).
+template<typename Index, typename F>
+void parallel_for(Pool& pool, Index first, Index last, size_t grain, F&& f);
+
+// Folds map(i) for every i in [first, last) into identity with reduce, which has to be associative and
+// commutative: every participant folds its own chunks, and the partial results are combined in no fixed order.
+template<typename Index, typename T, typename Map, typename Reduce>
+T parallel_reduce(Pool& pool, Index first, Index last, size_t grain, T identity, Map&& map, Reduce&& reduce);
+
+// out[i] = f(first[i]) for every element of [first, last).  Both sides need random access iterators.
+template<typename InputIt, typename OutputIt, typename F>
+OutputIt parallel_transform(Pool& pool, InputIt first, InputIt last, OutputIt out, size_t grain, F&& f);
+
+// Sorts runs of the range in parallel, then merges pairs of runs in parallel until one is left.  Stable if
+// stable is true.  Needs a buffer as big as the range.
+template<typename RandomIt, typename Compare = std::less<>>
+void parallel_sort(Pool& pool, RandomIt first, RandomIt last, Compare comp = Compare(), bool stable = false);
+
+}
+}
+
+#include "Parallel.cpp"
+
+#endif
@@ -6,10 +6,36 @@
 namespace Cutter {
 namespace Plumbing {
 
+////// FLOW ///////
+template<typename T>
+Flow<T>::Flow(Topology topology, Cutter::Lockfree::EventCount* wake):
+    spsc_(topology == Topology::SPSC ? std::make_unique<Cutter::Lockfree::SPSCQueue<T>>(wake) : nullptr),
+    mpmc_(topology == Topology::MPMC ? std::make_unique<Cutter::Lockfree::Queue<T>>(wake) : nullptr)
+{}
+
+template<typename T>
+template<typename S>
+inline bool Flow<T>::enqueue(S&& value) noexcept {
+    if (spsc_)
+        return spsc_->try_enqueue(std::forward<S>(value));
+    mpmc_->enqueue(std::forward<S>(value));
+    return true;
+}
+
+template<typename T>
+inline std::optional<T> Flow<T>::dequeue(void) noexcept {
+    return spsc_ ? spsc_->dequeue() : mpmc_->dequeue();
+}
+
+template<typename T>
+inline bool Flow<T>::empty(void) const noexcept {
+    return spsc_ ? spsc_->empty() : mpmc_->empty();
+}
+
 ////// PIPE ///////
 template<typename T>
-Pipe<T>::Pipe(void):
-    flow(Cutter::Lockfree::Queue<T*>()),
+Pipe<T>::Pipe(Topology topology, Cutter::Lockfree::EventCount* wake):
+    flow(topology, wake),
     obj_mgr(Cutter::Memory::ObjectPool<T>()) 
 {}
 
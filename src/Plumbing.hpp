@@ -3,7 +3,9 @@
 #ifndef PLUMBING_HPP
 #define PLUMBING_HPP
 
+#include <chrono>
 #include <memory>
+#include <optional>
 #include <string>
 #include <type_traits> // Hoo boy.  Here we go...
 #include <tuple>
@@ -60,13 +62,41 @@ struct has_call_operator: std::false_type {};
 template<typename T>
 struct has_call_operator<T, std::void_t< decltype(&T::operator()) >>: std::true_type {};
 
-// A "Pipe" will connect joints.  It controls the flow of data between each task.
+// Whether a pipe can count on exactly one thread producing into it and one thread consuming from it.
+enum class Topology { MPMC, SPSC };
+
+// The queue along a pipe.  When the pipeline guarantees a single thread at either end of the edge it is backed
+// by an SPSCQueue, which needs no CAS at all; otherwise by the MPMC Queue.  The choice is made once when the
+// pipe is built, so all it costs afterwards is a perfectly predictable branch per operation.  Only the queue in use
+// is ever made.  Either queue notifies wake, if there is one, when something is enqueued, so that threads parked on
+// it find the new element.
+//
+// An SPSC flow is bounded: it holds at most spsc_capacity elements.  enqueue returns false when it is full and leaves
+// the value with the caller, who should hold on to it and try again later (e.g. after doing some other work) rather
+// than spin, because the consumer may be the very thread that is waiting.  An MPMC flow is unbounded and its
+// enqueue always succeeds.
+template<typename T>
+class Flow {
+public:
+    static constexpr size_t spsc_capacity = Cutter::Lockfree::SPSCQueue<T>::max_size;
+private:
+    std::unique_ptr<Cutter::Lockfree::SPSCQueue<T>> spsc_;
+    std::unique_ptr<Cutter::Lockfree::Queue<T>> mpmc_;
+public:
+    Flow(Topology, Cutter::Lockfree::EventCount* wake = nullptr);
+    template<typename S> inline bool enqueue(S&&) noexcept;
+    inline std::optional<T> dequeue(void) noexcept;
+    inline bool empty(void) const noexcept;
+};
+
+// A "Pipe" will connect joints.  It controls the flow of data between each task.  Pipes between pinned stages are
+// bounded, see Flow.
 template<typename T>
 struct Pipe {
     using type = T;
-    Cutter::Lockfree::Queue<T*> flow;
+    Flow<T*> flow;
     Cutter::Memory::ObjectPool<T> obj_mgr;
-    Pipe(void);
+    Pipe(Topology = Topology::MPMC, Cutter::Lockfree::EventCount* wake = nullptr);
 };
 
 // This will serve as a base class template for all the types of segments we'll deal with (Source, Transform, Sink).
@@ -323,17 +353,18 @@ getStage(Pipeline<Jnt, Rest...>& pl) {
 
 // These next two function templates are used to look for available work in a pipeline from the
 // sink end towards the source end.
+// Returns whether any stage had work to do.
 template<int I = 0, typename... Args>
-inline std::enable_if_t<I == -1> searchForWork(Pipeline<Args...>&) {} // noop
+inline std::enable_if_t<I == -1, bool> searchForWork(Pipeline<Args...>&) { return false; } // noop
 
 template<int I = 0, typename... Args>
-inline std::enable_if_t<(I > -1)> searchForWork(Pipeline<Args...>& p) {
+inline std::enable_if_t<(I > -1), bool> searchForWork(Pipeline<Args...>& p) {
     bool found_work = getStage<I>(p).getJoint().work();
     if (found_work) {
-       return;
+       return true;
     }
     else {
-        searchForWork<I - 1, Args...>(p);
+        return searchForWork<I - 1, Args...>(p);
     }
 }
 
@@ -369,6 +400,14 @@ private:
     std::shared_ptr<Pipe<typename Src::output_type>> pipe_;
 
     static constexpr size_t n_joints = sizeof...(Args) + 1;
+    // With exactly one thread per stage, every thread stays at its own stage and each pipe has one producer and
+    // one consumer.  Otherwise idle threads go looking for work at other stages, so pipes have to be MPMC.
+    static constexpr bool pinned = Cutter::Const::THREAD_COUNT == n_joints;
+    static constexpr Topology edges = pinned ? Topology::SPSC : Topology::MPMC;
+    // Threads that find nothing to do anywhere in the pipeline park here instead of spinning.  The queue behind
+    // every pipe notifies it when something is enqueued, and stop() notifies it too, so there is no need for a
+    // timeout.
+    Cutter::Lockfree::EventCount idle_;
 
     // ready() is defined by checking whether the upstream queue is empty or not (in the case of Transform or Sink).
     // in the case of Source, we check if there are any files remaining.
@@ -394,13 +433,13 @@ private:
 
 public:
     PipelineImpl(Src&& src, Args&&... args): 
-      PipelineImpl<void, Args...>(std::forward<Args>(args)...),
+      PipelineImpl<void, Args...>(edges, &idle_, std::forward<Args>(args)...),
       started_(std::atomic<bool>(false)),
       pad1{0},
       stopped_(std::atomic<bool>(false)),
       pad2{0},
       joint_(std::forward<Src>(src)),
-      pipe_(std::make_shared<Pipe<typename Src::output_type>>()) {
+      pipe_(std::make_shared<Pipe<typename Src::output_type>>(edges, &idle_)) {
         joint_.setDownstream(pipe_);
         // Cast *this to the downstream pipeline type and set the upstream pipe of the next segment
         PipelineImpl<void, Args...>& next = *this;
@@ -423,9 +462,7 @@ public:
      
     inline void threadCleanUp(void);
     /*
-    *Queue<work_t>::hptr_a = nullptr;
-    *Queue<work_t>::hptr_b = nullptr;
-    Queue<work_t>::scan(this->q->mempool->head());
+    Queue<work_t>::reclamation::quiesce();
     */
     inline void monitor(void) {}
 
@@ -438,7 +475,14 @@ public:
                             doWorkForThread(tid);
                             continue;
                         }
-                        searchForWork<std::remove_reference<decltype(*this)>::type::n_joints>(*this);
+                        if (!pinned && searchForWork<std::remove_reference<decltype(*this)>::type::n_joints>(*this))
+                            continue;
+                        uint32_t key = idle_.prepareWait();
+                        if (this->stopped_.load()) {
+                            idle_.cancelWait();
+                            break;
+                        }
+                        idle_.wait(key);
                     }
                     /*
                     // Clean up hzd ptrs for each pipeline stage
@@ -453,7 +497,12 @@ public:
         }
     }
 
-    inline void stop(void) {}
+    inline void stop(void) {
+        stopped_ = true;
+        idle_.notifyAll();
+        for (auto& thread : milpool_) thread.join();
+        milpool_.clear();
+    }
 };
 
 // Partial specialization for when Derived inherits from Sink<Derived, out_t>
@@ -469,6 +518,11 @@ class PipelineImpl<
 protected:
     Snk joint_;
 public:
+    // The sink has no downstream pipe, so it has no use for the topology or the wakeup.
+    PipelineImpl(Topology, Cutter::Lockfree::EventCount*, Snk&& snk, Args&&... args): 
+      PipelineImpl(std::forward<Snk>(snk), std::forward<Args>(args)...)
+    {}
+
     PipelineImpl(Snk&& snk, Args&&... args): 
       PipelineImpl<void, Args...>(std::forward<Args>(args)...),
       joint_(std::forward<Snk>(snk))
@@ -505,8 +559,15 @@ private:
     std::shared_ptr<Pipe<typename Trf::output_type>> pipe_;
 public:
     PipelineImpl(Trf&& trf, Args&&... args): 
-      PipelineImpl<void, Args...>(std::forward<Args>(args)...),
-      joint_(std::forward<Trf>(trf))
+      PipelineImpl(Topology::MPMC, nullptr, std::forward<Trf>(trf), std::forward<Args>(args)...)
+    {}
+
+    // The topology is decided at the source, which is the only stage that knows the length of the pipeline.  The
+    // source also owns the pipeline's threads, so it hands down what they park on.
+    PipelineImpl(Topology edges, Cutter::Lockfree::EventCount* wake, Trf&& trf, Args&&... args): 
+      PipelineImpl<void, Args...>(edges, wake, std::forward<Args>(args)...),
+      joint_(std::forward<Trf>(trf)),
+      pipe_(std::make_shared<Pipe<typename Trf::output_type>>(edges, wake))
       {
         joint_.setDownstream(pipe_);
         PipelineImpl<void, Args...>& next = *this;
@@ -1,31 +1,153 @@
 #include <functional>
 #include <future>
-#include <iostream>
 #include <optional>
 #include <thread>
 #include <vector>
 #include <unistd.h>
 
 #include "Lockfree.hpp"
+#include "Memory.hpp"
 #include "Constants.hpp"
 
 template<typename T>
 using Queue = Cutter::Lockfree::Queue<T>;
 
-using work_t = std::function<void()>;
-
 namespace Cutter {
 namespace Proletariat {
 
-Pool::Pool(int num_threads): 
+/********* START TASK *********/
+
+template<typename F>
+struct Task::Inline {
+    static void invoke(void* p) {
+        (*static_cast<F*>(p))();
+    }
+    static void relocate(void* from, void* to) noexcept {
+        new (to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+    }
+    static void destroy(void* p) noexcept {
+        static_cast<F*>(p)->~F();
+    }
+    static constexpr Ops ops{&invoke, &relocate, &destroy};
+};
+
+// The task's storage holds a pointer to the callable.
+template<typename F>
+struct Task::Boxed {
+    static F*& ptr(void* p) {
+        return *static_cast<F**>(p);
+    }
+    static void invoke(void* p) {
+        (*ptr(p))();
+    }
+    static void relocate(void* from, void* to) noexcept {
+        new (to) F*(ptr(from));
+    }
+    static void destroy(void* p) noexcept {
+        delete ptr(p);
+    }
+    static constexpr Ops ops{&invoke, &relocate, &destroy};
+};
+
+inline Task::Task(void) noexcept: ops_(nullptr) {}
+
+template<typename F, typename>
+Task::Task(F&& f) {
+    using Callable = std::decay_t<F>;
+    if constexpr (fits<Callable>) {
+        new (storage_) Callable(std::forward<F>(f));
+        ops_ = &Inline<Callable>::ops;
+    }
+    else {
+        new (storage_) Callable*(new Callable(std::forward<F>(f)));
+        ops_ = &Boxed<Callable>::ops;
+    }
+}
+
+inline Task::Task(Task&& other) noexcept: ops_(other.ops_) {
+    if (ops_ != nullptr) {
+        ops_->relocate(other.storage_, storage_);
+        other.ops_ = nullptr;
+    }
+}
+
+inline Task& Task::operator= (Task&& other) noexcept {
+    if (this == &other)
+        return *this;
+    if (ops_ != nullptr) 
+        ops_->destroy(storage_);
+    ops_ = other.ops_;
+    if (ops_ != nullptr) {
+        ops_->relocate(other.storage_, storage_);
+        other.ops_ = nullptr;
+    }
+    return *this;
+}
+
+inline Task::~Task(void) {
+    if (ops_ != nullptr) 
+        ops_->destroy(storage_);
+}
+
+inline void Task::operator()(void) {
+    ops_->invoke(storage_);
+}
+
+inline Task::operator bool(void) const noexcept {
+    return ops_ != nullptr;
+}
+
+/********* START POOL *********/
+
+DeadlineMissed::DeadlineMissed(void): std::runtime_error("Task was dropped after missing its deadline") {}
+
+Pool::Picker::Picker(void): credit{0} {}
+
+size_t Pool::Picker::next(const Weights& weights) {
+    int64_t total = 0;
+    size_t best = 0;
+    for (size_t lane = 0; lane < N_PRIORITIES; ++lane) {
+        credit[lane] += weights[lane];
+        total += weights[lane];
+        if (credit[lane] > credit[best]) 
+            best = lane;
+    }
+    credit[best] -= total;
+    return best;
+}
+
+Pool::Worker::Worker(uint64_t s):
+    tasks(),
+    seed(s),
+    picker()
+{}
+
+Pool::Counter::Counter(void): n(std::atomic<uint64_t>(0)) {}
+
+Pool::Pool(int num_threads, Scheduling scheduling, Weights weights): 
     size(num_threads), 
+    scheduling_(scheduling),
+    weights_(weights),
+    on_error_(),
     started_(std::atomic<bool>(false)),
     pad1{0},
     stopped_(std::atomic<bool>(false)),
     pad2{0},
-    q(std::make_shared<Queue<work_t>>()),
-    pool_(std::vector<std::thread>())
-{}
+    lanes_(),
+    pool_(std::vector<std::thread>()),
+    workers_(),
+    tasks_(scheduling == Scheduling::Stealing ? std::make_unique<Cutter::Memory::ObjectPool<work_t>>() : nullptr),
+    idle_(),
+    scheduled_(),
+    finished_(),
+    late_()
+{
+    for (auto& lane : lanes_) 
+        lane = std::make_unique<Queue<work_t>>();
+    for (int i = 0; i < size; ++i) 
+        workers_.push_back(std::make_unique<Worker>(0x9E3779B97F4A7C15ull * (i + 1)));
+}
 
 Pool::~Pool(void) {
     if (!stopped_.load()) {
@@ -35,57 +157,434 @@ Pool::~Pool(void) {
 
 void Pool::stop(bool wait_for_complete) {
     if (wait_for_complete)
-        while (!q->empty()) continue;
+        while (!allFinished()) std::this_thread::yield();
 
     stopped_ = true; // Send the signal to all the workers to pack it up
+    idle_.notifyAll();
     for (auto& worker : pool_) worker.join();
+    // Whatever's left on the deques and in the lanes is never going to run.  Throwing it away now, rather than
+    // when the pool is destroyed, breaks its promises, so nobody waits on it forever.
+    for (auto& worker : workers_) {
+        while (auto task = worker->tasks.pop()) tasks_->free(*task);
+    }
+    for (auto& lane : lanes_) {
+        while (lane->dequeue()) {}
+    }
+    Queue<work_t>::reclamation::quiesce();
 }
     
 void Pool::start(void) {
-    for (int i = 0; i < size; ++i) {
-        pool_.emplace_back([this] (void) noexcept {
-            while (!this->stopped_.load()) {
-                std::optional<work_t> task = this->q->dequeue();
-                if (!this->stopped_.load() && task) {
-                    (*task)();
-                }
+    for (int i = 0; i < size; ++i) 
+        pool_.emplace_back([this, i] (void) noexcept { runWorker(*workers_[i]); });
+    started_ = true;
+}
+
+bool Pool::started(void) const {
+    return started_.load() && !stopped_.load();
+}
+
+void Pool::runWorker(Worker& self) {
+    current_ = Current{this, &self};
+    while (!stopped_.load()) {
+        if (runOne(&self, self.seed, self.picker))
+            continue;
+        // Nothing anywhere.  Check once more after announcing that we're about to sleep, so that a task submitted
+        // in between either shows up here or wakes us.
+        uint32_t key = idle_.prepareWait();
+        if (stopped_.load() || hasWork()) {
+            idle_.cancelWait();
+            continue;
+        }
+        Queue<work_t>::reclamation::quiesce();
+        idle_.wait(key, idle_timeout);
+    }
+    // Clean up any remaining hzd ptrs
+    Queue<work_t>::reclamation::quiesce();
+    current_ = Current{nullptr, nullptr};
+}
+
+// The lane whose turn it is first, then the rest in order of priority.
+bool Pool::runOne(Worker* self, uint64_t& seed, Picker& picker) {
+    size_t preferred = picker.next(weights_);
+    if (runFrom(preferred, self, seed))
+        return true;
+    for (size_t lane = 0; lane < N_PRIORITIES; ++lane) {
+        if (lane != preferred && runFrom(lane, self, seed))
+            return true;
+    }
+    return false;
+}
+
+// From the Normal lane when Stealing: our own newest task first (if we're one of the workers), then the oldest
+// submitted from outside, then the oldest of somebody else's.
+bool Pool::runFrom(size_t lane, Worker* self, uint64_t& seed) {
+    bool stealing = scheduling_ == Scheduling::Stealing && lane == static_cast<size_t>(Priority::Normal);
+    if (stealing && self != nullptr) {
+        if (auto task = self->tasks.pop()) {
+            run(**task);
+            tasks_->free(*task);
+            return true;
+        }
+    }
+    if (auto task = lanes_[lane]->dequeue()) {
+        run(*task);
+        return true;
+    }
+    if (!stealing)
+        return false;
+    size_t n = workers_.size();
+    size_t first = n > 0 ? random(seed) % n : 0;
+    for (size_t i = 0; i < n; ++i) {
+        Worker& victim = *workers_[(first + i) % n];
+        if (&victim == self) 
+            continue;
+        if (auto task = victim.tasks.steal()) {
+            run(**task);
+            tasks_->free(*task);
+            return true;
+        }
+    }
+    return false;
+}
+
+// A task that throws still counts as finished, or stop(true) would wait for it forever.
+inline void Pool::run(work_t& task) {
+    try {
+        task();
+    }
+    catch (...) {
+        if (on_error_) {
+            try {
+                on_error_(std::current_exception());
             }
-            // Clean up any remaining hzd ptrs
-            *Queue<work_t>::hptr_a = nullptr;
-            *Queue<work_t>::hptr_b = nullptr;
-            Queue<work_t>::scan(this->q->mempool->head());
-        });
+            catch (...) {}
+        }
     }
-    started_ = true;
+    count(finished_);
+}
+
+bool Pool::help(void) {
+    if (current_.pool == this)
+        return runOne(current_.worker, current_.worker->seed, current_.worker->picker);
+    thread_local uint64_t seed = 0x9E3779B97F4A7C15ull ^ reinterpret_cast<uintptr_t>(&seed);
+    thread_local Picker picker;
+    return runOne(nullptr, seed, picker);
+}
+
+bool Pool::hasWork(void) const {
+    for (auto& lane : lanes_) {
+        if (!lane->empty())
+            return true;
+    }
+    for (auto& worker : workers_) {
+        if (!worker->tasks.empty())
+            return true;
+    }
+    return false;
+}
+
+// Each counter only ever goes up.  Reading every finished count before any scheduled count means that, if the
+// sums match, there was a moment when everything scheduled had finished: a task counts whatever it schedules
+// before it counts itself finished.
+bool Pool::allFinished(void) const {
+    uint64_t finished = 0;
+    uint64_t scheduled = 0;
+    for (auto& counter : finished_) finished += counter.n.load(std::memory_order_acquire);
+    for (auto& counter : scheduled_) scheduled += counter.n.load(std::memory_order_acquire);
+    return finished == scheduled;
+}
+
+uint64_t Pool::late(void) const {
+    uint64_t n = 0;
+    for (auto& counter : late_) n += counter.n.load(std::memory_order_acquire);
+    return n;
+}
+
+void Pool::onError(std::function<void(std::exception_ptr)> handler) {
+    on_error_ = std::move(handler);
+}
+
+bool Pool::overdue(Clock::time_point deadline, bool drop_late) {
+    if (Clock::now() < deadline)
+        return false;
+    count(late_);
+    return drop_late;
+}
+
+inline void Pool::count(Counter* counters) {
+    size_t id = Cutter::Memory::ThreadSlot::id();
+    if (id == Cutter::Memory::ThreadSlot::NONE) {
+        counters[N_COUNTERS - 1].n.fetch_add(1, std::memory_order_acq_rel);
+        return;
+    }
+    // Nobody else writes to this one.
+    std::atomic<uint64_t>& n = counters[id].n;
+    n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool Pool::schedule(work_t&& task, Priority priority) {
+    if (!started())
+        return false;
+    count(scheduled_);
+    if (scheduling_ == Scheduling::Stealing && priority == Priority::Normal && current_.pool == this) 
+        current_.worker->tasks.push(tasks_->alloc(std::move(task)));
+    else 
+        lanes_[static_cast<size_t>(priority)]->enqueue(std::move(task));
+    idle_.notify();
+    return true;
+}
+
+// xorshift64
+inline uint64_t Pool::random(uint64_t& state) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
 }
     
-// We assume that there is no return value from f, or that f itself is handling the results of it's own internal work
 template<typename Func, typename... Args>
-bool Pool::submit(Func&& f, Args&&... args) noexcept {
-    using return_type = typename std::result_of<Func(Args...)>::type;
+std::future<Pool::result_t<Func, Args...>> Pool::submit(Func&& f, Args&&... args) {
+    return submit(Options(), std::forward<Func>(f), std::forward<Args>(args)...);
+}
+
+// The promise, the callable and its arguments all live in the task, which runs once, so they can be moved out.
+// late defaults to false so that the task can be scheduled as it is when there's no deadline to check.
+template<typename Func, typename... Args>
+auto Pool::deliver(std::promise<result_t<Func, Args...>>&& promise, Func&& f, Args&&... args) {
+    return [
+        promise = std::move(promise), 
+        f = std::forward<Func>(f), 
+        args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)
+    ] (bool late = false) mutable {
+        if (late) {
+            promise.set_exception(std::make_exception_ptr(DeadlineMissed()));
+            return;
+        }
+        try {
+            if constexpr (std::is_void<result_t<Func, Args...>>::value) {
+                std::apply(std::move(f), std::move(args));
+                promise.set_value();
+            }
+            else {
+                promise.set_value(std::apply(std::move(f), std::move(args)));
+            }
+        }
+        catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    };
+}
+
+template<typename Func, typename... Args>
+std::future<Pool::result_t<Func, Args...>> Pool::submit(const Options& options, Func&& f, Args&&... args) {
+    using return_type = result_t<Func, Args...>;
 
     // Idiot checks at compile and run-time
     static_assert(
         std::is_invocable<Func, Args...>::value, 
         "Error: Cannot submit non-callable object as work to thread pool."
     );
-    if (not started_.load()) {
-        std::cout << "Error: Cannot submit work. Threadpool not yet started!" << std::endl;
-        return false;
+    std::promise<return_type> promise;
+    std::future<return_type> result = promise.get_future();
+    auto job = deliver(std::move(promise), std::forward<Func>(f), std::forward<Args>(args)...);
+    bool scheduled;
+    // Only tasks that have a deadline pay for checking it.
+    if (options.deadline == Clock::time_point::max()) {
+        scheduled = schedule(std::move(job), options.priority);
+    }
+    else {
+        scheduled = schedule(
+            [this, deadline = options.deadline, drop_late = options.drop_late, job = std::move(job)] (void) mutable {
+                job(overdue(deadline, drop_late));
+            },
+            options.priority
+        );
     }
-    // Make the task to execute and put it in the queue.
-    auto task = std::make_shared<std::packaged_task<return_type()>>(
-        std::bind(
-            std::forward<Func>(f), 
-            std::forward<Args>(args)...
-        )
+    return scheduled ? std::move(result) : std::future<return_type>();
+}
+
+template<typename Func, typename... Args>
+std::enable_if_t<!std::is_same<std::decay_t<Func>, Options>::value, bool> Pool::post(Func&& f, Args&&... args) {
+    return post(Options(), std::forward<Func>(f), std::forward<Args>(args)...);
+}
+
+// Only tasks that have a deadline pay for checking it.
+template<typename Func, typename... Args>
+bool Pool::post(const Options& options, Func&& f, Args&&... args) {
+    static_assert(
+        std::is_invocable<Func, Args...>::value, 
+        "Error: Cannot submit non-callable object as work to thread pool."
     );
-    q->enqueue(
-        [task] (void) noexcept {
-            (*task)();
+    if (options.deadline != Clock::time_point::max()) {
+        return schedule(
+            [
+                this,
+                deadline = options.deadline, 
+                drop_late = options.drop_late,
+                f = std::forward<Func>(f), 
+                args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)
+            ] (void) mutable {
+                if (!overdue(deadline, drop_late))
+                    std::apply(std::move(f), std::move(args));
+            },
+            options.priority
+        );
+    }
+    if constexpr (sizeof...(Args) == 0) {
+        return schedule(std::forward<Func>(f), options.priority);
+    }
+    else {
+        return schedule(
+            [
+                f = std::forward<Func>(f), 
+                args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)
+            ] (void) mutable {
+                std::apply(std::move(f), std::move(args));
+            },
+            options.priority
+        );
+    }
+}
+
+/********* START TASK GROUP *********/
+
+TaskGroup::TaskGroup(Pool& pool):
+    pool_(pool),
+    pending_(std::atomic<size_t>(0)),
+    mtx_(),
+    error_()
+{}
+
+TaskGroup::Ticket::Ticket(TaskGroup* g) noexcept: group(g) {}
+
+TaskGroup::Ticket::Ticket(Ticket&& other) noexcept: group(other.group) {
+    other.group = nullptr;
+}
+
+TaskGroup::Ticket::~Ticket(void) {
+    if (group == nullptr)
+        return;
+    group->fail(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    punch();
+}
+
+// The group may be gone as soon as this lands, so it's the last thing we touch.
+void TaskGroup::Ticket::punch(void) {
+    TaskGroup* g = group;
+    group = nullptr;
+    g->pending_.fetch_sub(1, std::memory_order_release);
+}
+
+TaskGroup::~TaskGroup(void) {
+    try {
+        wait();
+    }
+    catch (...) {}
+}
+
+void TaskGroup::fail(std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (!error_) error_ = error;
+}
+
+template<typename Func, typename... Args>
+void TaskGroup::run(Func&& f, Args&&... args) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    auto task = [
+        ticket = Ticket(this), 
+        f = std::forward<Func>(f), 
+        args = std::tuple<std::decay_t<Args>...>(std::forward<Args>(args)...)
+    ] (void) mutable {
+        try {
+            std::apply(std::move(f), std::move(args));
         }
-    );
-    return true;
+        catch (...) {
+            ticket.group->fail(std::current_exception());
+        }
+        ticket.punch();
+    };
+    // A refused task is handed back untouched, so it can still be run here.
+    work_t work(std::move(task));
+    if (!pool_.started() || !pool_.post(std::move(work)))
+        work();
+}
+
+void TaskGroup::wait(void) {
+    while (pending_.load(std::memory_order_acquire) != 0) {
+        if (!pool_.help()) 
+            std::this_thread::yield();
+    }
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        std::swap(error, error_);
+    }
+    if (error)
+        std::rethrow_exception(error);
+}
+
+/********* START TASK GRAPH *********/
+
+TaskGraph::Vertex::Vertex(work_t&& w):
+    work(std::move(w)),
+    successors(),
+    n_predecessors(0),
+    countdown(std::atomic<size_t>(0))
+{}
+
+TaskGraph::TaskGraph(Pool& pool):
+    vertices_(),
+    group_(pool),
+    failed_(std::atomic<bool>(false))
+{}
+
+template<typename Func>
+TaskGraph::Node TaskGraph::add(Func&& f, std::initializer_list<Node> after) {
+    return add(std::forward<Func>(f), std::vector<Node>(after));
+}
+
+template<typename Func>
+TaskGraph::Node TaskGraph::add(Func&& f, const std::vector<Node>& after) {
+    Node node = vertices_.size();
+    vertices_.push_back(std::make_unique<Vertex>(work_t(std::forward<Func>(f))));
+    for (Node predecessor : after) 
+        vertices_.at(predecessor)->successors.push_back(node);
+    vertices_.back()->n_predecessors = after.size();
+    return node;
+}
+
+void TaskGraph::run(void) {
+    failed_ = false;
+    for (auto& vertex : vertices_) 
+        vertex->countdown.store(vertex->n_predecessors, std::memory_order_relaxed);
+    for (Node node = 0; node < vertices_.size(); ++node) {
+        if (vertices_[node]->n_predecessors == 0) 
+            schedule(node);
+    }
+}
+
+// Successors are scheduled from inside the node's task, so the group can't run dry before they're in it.
+void TaskGraph::schedule(Node node) {
+    group_.run([this, node] (void) {
+        Vertex& vertex = *vertices_[node];
+        if (!failed_.load(std::memory_order_relaxed)) {
+            try {
+                vertex.work();
+            }
+            catch (...) {
+                failed_ = true;
+                throw;
+            }
+        }
+        for (Node successor : vertex.successors) {
+            if (vertices_[successor]->countdown.fetch_sub(1, std::memory_order_acq_rel) == 1) 
+                schedule(successor);
+        }
+    });
+}
+
+void TaskGraph::wait(void) {
+    group_.wait();
 }
 
 } // end namespace Proletariat
@@ -1,12 +1,27 @@
 #ifndef PROLETARIAT_HPP
 #define PROLETARIAT_HPP
 
+#include <array>
 #include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <exception>
+#include <future>
+#include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include <gtest/gtest_prod.h>
+
 #include "Lockfree.hpp"
+#include "Memory.hpp"
 #include "Constants.hpp"
 
 template<typename T>
@@ -15,32 +30,276 @@ using Queue = Cutter::Lockfree::Queue<T>;
 namespace Cutter {
 namespace Proletariat {
 
-using work_t = std::function<void()>;
+// A move only stand-in for std::function<void()>.  Callables of up to INLINE_SIZE bytes are kept inside the task
+// itself, so wrapping a small lambda doesn't allocate, and a task fits in a cache line.  Bigger callables, and
+// ones that might throw while being moved, go on the heap.
+class Task {
+public:
+    static constexpr size_t INLINE_SIZE = Cutter::Const::CACHE_LINE_SIZE - sizeof(void*);
+
+    // Empty.
+    Task(void) noexcept;
+    template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, Task>::value>>
+    Task(F&& f);
+    Task(Task&&) noexcept;
+    Task& operator= (Task&&) noexcept;
+    ~Task(void);
+
+    Task(const Task&) = delete;
+    Task& operator= (const Task&) = delete;
+
+    void operator()(void);
+    explicit operator bool(void) const noexcept;
+
+private:
+    struct Ops {
+        void (*invoke)(void*);
+        void (*relocate)(void* from, void* to) noexcept;    // Move from into to, and destroy from
+        void (*destroy)(void*) noexcept;
+    };
+    template<typename F> struct Inline;
+    template<typename F> struct Boxed;
+    template<typename F>
+    static constexpr bool fits = 
+        sizeof(F) <= INLINE_SIZE && 
+        alignof(F) <= alignof(std::max_align_t) && 
+        std::is_nothrow_move_constructible<F>::value;
+
+    alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+    const Ops* ops_;
+
+    FRIEND_TEST(TaskTest, SubmittedTasksAreStoredInline);
+};
+
+using work_t = Task;
+
+// How a Pool hands out work.  Shared sends every task through one queue, which every worker takes from.  Stealing
+// gives each worker a deque of its own: tasks submitted by a worker go on its deque, tasks submitted from any other
+// thread go through an injection queue, and a worker with nothing left to do steals from the others, starting at a
+// random one.  Jobs that fan out recursively then mostly stay on the worker that made them, instead of every
+// worker fighting over the head and tail of one queue.
+enum class Scheduling { Shared, Stealing };
+
+// Every Pool has a lane of work per priority.  Stealing only ever applies to Normal work: a worker's own deque only
+// holds Normal tasks, and High and Background tasks always go through their lane's queue.
+enum class Priority : size_t { High, Normal, Background };
+constexpr size_t N_PRIORITIES = 3;
+
+// How often each lane gets first pick, relative to the others, when they all have work waiting.  A lane that's
+// empty gives its turn to the others in order of priority, so no worker idles while there's work anywhere.  A lane
+// with a weight of 0 never gets first pick, so it only runs when the others are empty; with all zeros, lanes are
+// simply taken in order of priority.
+using Weights = std::array<unsigned, N_PRIORITIES>;
+constexpr Weights DEFAULT_WEIGHTS{16, 4, 1};
+
+using Clock = std::chrono::steady_clock;
+
+// How to schedule a task.  A task that is still waiting when its deadline passes is late.  It is dropped if
+// drop_late is set, and run anyway otherwise.  Either way the pool counts it, and a dropped task's future gets
+// a DeadlineMissed.
+struct Options {
+    Priority priority = Priority::Normal;
+    Clock::time_point deadline = Clock::time_point::max();
+    bool drop_late = true;
+};
+
+class DeadlineMissed: public std::runtime_error {
+public:
+    DeadlineMissed(void);
+};
 
 class Pool {
 public:
     const int size;
-    Pool(int num_threads);
+    Pool(int num_threads, Scheduling scheduling = Scheduling::Shared, Weights weights = DEFAULT_WEIGHTS);
     ~Pool(void);
 
     // Delete copy and assignment operators
     Pool(const Pool&) = delete;
     Pool& operator= (const Pool&) = delete;
 
-    void stop(bool = false);
+    // With wait_for_complete, waits until every task scheduled so far, and every task those schedule, has
+    // finished running.  Otherwise, tasks that haven't started are destroyed without being run: their futures
+    // report a broken promise, and so do the TaskGroups they belong to.
+    void stop(bool wait_for_complete = false);
     void start(void);
+    // Started and not yet stopped.
+    bool started(void) const;
+    // Runs one task that's waiting to be run, on the calling thread, so that a thread waiting on the pool can
+    // make itself useful.  Returns false if it found nothing.
+    bool help(void);
      
     template<typename Func, typename... Args>
-    bool submit(Func&& f, Args&&... args) noexcept;
+    using result_t = std::invoke_result_t<std::decay_t<Func>, std::decay_t<Args>...>;
+
+    // Runs f(args...) on the pool, and hands back a future for whatever it returns or throws.  f and args are
+    // copied or moved into the task, which is the only place they're stored, so the only allocation is the
+    // future's shared state, unless they're too big to be stored inline.  If the pool isn't running, nothing is
+    // run and the future is invalid.
+    template<typename Func, typename... Args>
+    std::future<result_t<Func, Args...>> submit(Func&& f, Args&&... args);
+    // Like submit, for when nobody wants the result.  With nothing to report back there's nothing to allocate,
+    // unless the callable is too big to be stored inline.  Returns false if the pool isn't running.  Whatever
+    // the callable throws goes to the error handler, if there is one, and is dropped otherwise.
+    template<typename Func, typename... Args>
+    std::enable_if_t<!std::is_same<std::decay_t<Func>, Options>::value, bool> post(Func&& f, Args&&... args);
+    // The same, with a priority and a deadline.
+    template<typename Func, typename... Args>
+    std::future<result_t<Func, Args...>> submit(const Options& options, Func&& f, Args&&... args);
+    template<typename Func, typename... Args>
+    bool post(const Options& options, Func&& f, Args&&... args);
+    // How many tasks have been picked up after their deadlines, whether they were dropped or run.
+    uint64_t late(void) const;
+    // Handed whatever a posted task throws, on the thread that ran it.  Set it before the pool is started.
+    void onError(std::function<void(std::exception_ptr)> handler);
 
 private:
+    // How long an idle worker sleeps before it checks again whether the pool has been stopped.
+    static constexpr std::chrono::milliseconds idle_timeout{100};
+
+    // Smooth weighted round robin: every turn, each lane earns its weight in credit, and the richest lane gets
+    // first pick and pays for it with the total of the weights.  That spreads each lane's turns out evenly,
+    // rather than handing them out in runs.
+    struct Picker {
+        int64_t credit[N_PRIORITIES];
+        Picker(void);
+        size_t next(const Weights& weights);
+    };
+
+    struct alignas(Cutter::Const::CACHE_LINE_SIZE) Worker {
+        Cutter::Lockfree::StealingDeque<work_t*> tasks;
+        uint64_t seed;  // For picking whom to steal from
+        Picker picker;
+        Worker(uint64_t seed);
+    };
+
+    // Which pool, if any, the calling thread works for, and as which worker.
+    struct Current {
+        const Pool* pool;
+        Worker* worker;
+    };
+    static inline thread_local Current current_{nullptr, nullptr};
+
+    // Tasks scheduled and tasks finished, counted per thread (by Memory::ThreadSlot) so that no two threads bump
+    // the same counter.  Only the sums mean anything.  Threads that didn't get a slot share the last one.
+    struct alignas(Cutter::Const::CACHE_LINE_SIZE) Counter {
+        std::atomic<uint64_t> n;
+        Counter(void);
+    };
+    static constexpr size_t N_COUNTERS = Cutter::Memory::MAX_THREAD_SLOTS + 1;
+
+    const Scheduling scheduling_;
+    const Weights weights_;
+    std::function<void(std::exception_ptr)> on_error_;
+
     std::atomic<bool> started_;
     char pad1[Cutter::Const::CACHE_LINE_SIZE - sizeof(std::atomic<bool>)];
     std::atomic<bool> stopped_;
     char pad2[Cutter::Const::CACHE_LINE_SIZE - sizeof(std::atomic<bool>)];
-    // Here I want to make sure that the queue and the stopped_ controller are on different cache lines
-    std::shared_ptr<Queue<work_t>> q;
+    // Here I want to make sure that the queues and the stopped_ controller are on different cache lines
+    // One queue per priority.  When Stealing, the Normal one is the injection queue.
+    std::unique_ptr<Queue<work_t>> lanes_[N_PRIORITIES];
     std::vector<std::thread> pool_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    // Storage for the tasks on the workers' deques, which only hold pointers.  Only made when Stealing, since
+    // nothing else ever puts a task on a deque.
+    std::unique_ptr<Cutter::Memory::ObjectPool<work_t>> tasks_;
+    // Workers with nothing to do sleep here.
+    Cutter::Lockfree::EventCount idle_;
+    Counter scheduled_[N_COUNTERS];
+    Counter finished_[N_COUNTERS];
+    Counter late_[N_COUNTERS];
+
+    void runWorker(Worker& self);
+    bool runOne(Worker* self, uint64_t& seed, Picker& picker);
+    bool runFrom(size_t lane, Worker* self, uint64_t& seed);
+    inline void run(work_t& task);
+    bool hasWork(void) const;
+    bool allFinished(void) const;
+    bool schedule(work_t&& task, Priority priority = Priority::Normal);
+    // What submit runs: f(args...), with the outcome going to promise.  Called with late set, it skips f and
+    // reports a DeadlineMissed instead.
+    template<typename Func, typename... Args>
+    static auto deliver(std::promise<result_t<Func, Args...>>&& promise, Func&& f, Args&&... args);
+    // Counts a late task, and says whether to drop it.
+    bool overdue(Clock::time_point deadline, bool drop_late);
+    static inline void count(Counter* counters);
+    static inline uint64_t random(uint64_t& state);
+
+    FRIEND_TEST(TaskTest, SubmittedTasksAreStoredInline);
+};
+
+// Tasks run on a pool that can be waited for together.  wait() doesn't just block: the waiting thread runs tasks
+// from the pool until the group is done, so waiting from inside a task can't starve the pool of workers.  The
+// first exception thrown by any of the group's tasks is rethrown by wait(), and the rest are dropped.
+class TaskGroup {
+public:
+    explicit TaskGroup(Pool& pool);
+    // Waits, but swallows any exception.
+    ~TaskGroup(void);
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator= (const TaskGroup&) = delete;
+
+    // If the pool isn't running, f(args...) is run right here instead.
+    template<typename Func, typename... Args>
+    void run(Func&& f, Args&&... args);
+    // Once it returns, the group can be used again.
+    void wait(void);
+
+private:
+    // Each task carries one, and punches it when it's done.  A task that's destroyed without having been run
+    // counts as done too, and fails the group with a broken promise, so that wait() doesn't wait on it forever.
+    struct Ticket {
+        TaskGroup* group;
+        Ticket(TaskGroup* group) noexcept;
+        Ticket(Ticket&& other) noexcept;
+        ~Ticket(void);
+        void punch(void);
+    };
+
+    Pool& pool_;
+    alignas(Cutter::Const::CACHE_LINE_SIZE) std::atomic<size_t> pending_;
+    std::mutex mtx_;
+    std::exception_ptr error_;
+
+    void fail(std::exception_ptr error);
+};
+
+// A set of tasks some of which have to wait for others.  Each node counts down how many of its predecessors are
+// still to finish, and the predecessor that brings the count to zero schedules it, so nothing ever blocks waiting
+// on a dependency.  Nodes have to be added before the graph is run.  A graph can be run again once wait() has
+// returned.  If a node throws, the nodes that haven't started yet are skipped, and wait() rethrows.
+class TaskGraph {
+public:
+    using Node = size_t;
+
+    explicit TaskGraph(Pool& pool);
+    TaskGraph(const TaskGraph&) = delete;
+    TaskGraph& operator= (const TaskGraph&) = delete;
+
+    // A node that runs f() once every node in after has finished.
+    template<typename Func>
+    Node add(Func&& f, std::initializer_list<Node> after = {});
+    template<typename Func>
+    Node add(Func&& f, const std::vector<Node>& after);
+    // Starts every node that has no predecessors.
+    void run(void);
+    void wait(void);
+
+private:
+    struct Vertex {
+        work_t work;
+        std::vector<Node> successors;
+        size_t n_predecessors;
+        std::atomic<size_t> countdown;
+        Vertex(work_t&& work);
+    };
+
+    std::vector<std::unique_ptr<Vertex>> vertices_;
+    TaskGroup group_;
+    std::atomic<bool> failed_;
+
+    void schedule(Node node);
 };
 
 }
@@ -0,0 +1,241 @@
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../src/Lockfree.hpp"
+#include "../src/Memory.hpp"
+
+// Usage: bench-bin [items per run] [max threads per side] [normal|transparent|huge]
+//
+// Every queue is driven through the same enqueue/dequeue calls, for each combination of payload size, arrival
+// pattern and number of producers/consumers (powers of two up to the max).  Throughput counts an enqueue and a
+// dequeue as two operations.  Latency is the time from just before an element is enqueued to just after it is
+// dequeued, so it includes any time spent waiting in the queue.
+//
+// The last argument puts the queue's nodes in a Memory::NodeArena backed by that kind of page, and the dTLB
+// column counts the data TLB misses of the whole run, so the two can be compared between runs.  It reads "-"
+// where perf events aren't available (e.g. perf_event_paranoid is too strict, or inside some containers).
+
+using Clock = std::chrono::steady_clock;
+
+// Baseline to beat: the queue everybody writes first.
+template<typename T>
+class MutexQueue {
+    std::mutex mtx_;
+    std::deque<T> q_;
+public:
+    template<typename S>
+    void enqueue(S&& value) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        q_.emplace_back(std::forward<S>(value));
+    }
+
+    std::optional<T> dequeue(void) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (q_.empty())
+            return {};
+        T out = std::move(q_.front());
+        q_.pop_front();
+        return out;
+    }
+};
+
+// An element carrying its enqueue time, padded out to Bytes so that we can see what copying bigger elements costs.
+template<size_t Bytes>
+struct Payload {
+    static_assert(Bytes >= sizeof(int64_t), "Payload needs room for the timestamp.");
+    int64_t stamp;
+    char filler[Bytes - sizeof(int64_t)];
+};
+
+enum class Pattern { Steady, Burst };
+
+// In a burst, each producer enqueues this many elements back to back and then goes quiet for burst_gap.
+constexpr size_t burst_length = 256;
+constexpr auto burst_gap = std::chrono::microseconds(50);
+
+struct Result {
+    double ops_per_sec;
+    int64_t p50, p99, p999; // Nanoseconds
+    int64_t tlb_misses;     // -1 if they couldn't be counted
+};
+
+// Counts user space data TLB read misses in the calling thread and every thread it starts from now on.  Counts
+// from threads are only added in once they've exited, so read after joining them.
+class TlbMisses {
+    int fd_;
+public:
+    TlbMisses(void) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB 
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8) 
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~TlbMisses(void) {
+        if (fd_ >= 0) close(fd_);
+    }
+
+    int64_t read(void) const {
+        int64_t count;
+        if (fd_ < 0 || ::read(fd_, &count, sizeof(count)) != sizeof(count))
+            return -1;
+        return count;
+    }
+};
+
+inline int64_t now_ns(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+inline int64_t percentile(std::vector<int64_t>& samples, double p) {
+    if (samples.empty())
+        return 0;
+    auto nth = samples.begin() + static_cast<size_t>(p * (samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+
+// Push n_items through Q using the given number of producers and consumers.
+template<typename Q, typename T>
+Result run(int n_producers, int n_consumers, size_t n_items, Pattern pattern) {
+    // Some of these queues are big enough to blow the stack
+    auto q = std::make_unique<Q>();
+    std::atomic<bool> go(false);
+    std::atomic<size_t> n_consumed(0);
+    std::vector<std::vector<int64_t>> latencies(n_consumers);
+    std::vector<std::thread> threads;
+    // Started before any of the threads, so that it follows them all.  Setting up also counts, since that's
+    // where queues that allocate nodes spend their time.
+    TlbMisses tlb;
+
+    size_t per_producer = n_items / n_producers;
+    size_t total = per_producer * n_producers;
+    for (int p = 0; p < n_producers; ++p) {
+        threads.emplace_back([&, pattern] (void) {
+            T elt;
+            std::memset(&elt, 0, sizeof(T));
+            while (!go.load()) continue;
+            for (size_t i = 0; i < per_producer; ++i) {
+                if (pattern == Pattern::Burst && i % burst_length == 0 && i > 0)
+                    std::this_thread::sleep_for(burst_gap);
+                elt.stamp = now_ns();
+                q->enqueue(elt);
+            }
+        });
+    }
+    for (int c = 0; c < n_consumers; ++c) {
+        latencies[c].reserve(total / n_consumers + 1);
+        threads.emplace_back([&, c] (void) {
+            while (!go.load()) continue;
+            while (n_consumed.load(std::memory_order_relaxed) < total) {
+                auto elt = q->dequeue();
+                if (elt.has_value()) {
+                    latencies[c].push_back(now_ns() - elt->stamp);
+                    n_consumed.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        });
+    }
+
+    auto start = Clock::now();
+    go = true;
+    for (auto& t : threads) t.join();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    int64_t tlb_misses = tlb.read();
+
+    std::vector<int64_t> all;
+    all.reserve(total);
+    for (auto& l : latencies) all.insert(all.end(), l.begin(), l.end());
+    return {
+        2 * total / elapsed.count(),
+        percentile(all, 0.5),
+        percentile(all, 0.99),
+        percentile(all, 0.999),
+        tlb_misses
+    };
+}
+
+void report(const std::string& queue, size_t bytes, Pattern pattern, int producers, int consumers, const Result& r) {
+    std::cout << std::setw(12) << queue
+              << std::setw(8) << bytes
+              << std::setw(8) << (pattern == Pattern::Steady ? "steady" : "burst")
+              << std::setw(6) << producers
+              << std::setw(6) << consumers
+              << std::setw(14) << std::scientific << std::setprecision(3) << r.ops_per_sec
+              << std::setw(12) << r.p50
+              << std::setw(12) << r.p99
+              << std::setw(12) << r.p999
+              << std::setw(14) << (r.tlb_misses < 0 ? "-" : std::to_string(r.tlb_misses)) << std::endl;
+}
+
+template<size_t Bytes>
+void sweep(size_t n_items, int max_threads) {
+    using T = Payload<Bytes>;
+    // Balanced configurations, then lopsided ones where one side does all the contending.
+    std::vector<std::pair<int, int>> configs;
+    for (int n = 1; n <= max_threads; n *= 2)
+        configs.emplace_back(n, n);
+    if (max_threads > 1) {
+        configs.emplace_back(max_threads, 1);
+        configs.emplace_back(1, max_threads);
+    }
+    for (Pattern pattern : {Pattern::Steady, Pattern::Burst}) {
+        for (auto [p, c] : configs) {
+            report("Queue", Bytes, pattern, p, c, run<Cutter::Lockfree::Queue<T>, T>(p, c, n_items, pattern));
+            report("RingBuffer", Bytes, pattern, p, c, run<Cutter::Lockfree::RingBuffer<T>, T>(p, c, n_items, pattern));
+            report("MutexQueue", Bytes, pattern, p, c, run<MutexQueue<T>, T>(p, c, n_items, pattern));
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t n_items = argc > 1 ? std::stoul(argv[1]) : 1 << 20;
+    int max_threads = argc > 2 ? std::stoi(argv[2]) : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::string pages = argc > 3 ? argv[3] : "normal";
+
+    if (pages != "normal") {
+        using Cutter::Memory::Pages;
+        Pages got = Cutter::Memory::NodeArena::install(pages == "huge" ? Pages::Huge : Pages::Transparent);
+        std::cout << "Queue nodes are on " 
+                  << (got == Pages::Huge ? "huge" : got == Pages::Transparent ? "transparent huge" : "normal")
+                  << " pages" << std::endl;
+    }
+
+    std::cout << std::setw(12) << "queue"
+              << std::setw(8) << "bytes"
+              << std::setw(8) << "pattern"
+              << std::setw(6) << "prod"
+              << std::setw(6) << "cons"
+              << std::setw(14) << "ops/sec"
+              << std::setw(12) << "p50 (ns)"
+              << std::setw(12) << "p99 (ns)"
+              << std::setw(12) << "p999 (ns)"
+              << std::setw(14) << "dTLB misses" << std::endl;
+    sweep<8>(n_items, max_threads);
+    sweep<64>(n_items, max_threads);
+    sweep<256>(n_items, max_threads);
+    return 0;
+}
@@ -3,10 +3,14 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <future>
 #include <memory>
+#include <numeric>
+#include <stdexcept>
 #include <thread>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "../src/Lockfree.hpp"
@@ -77,3 +81,585 @@ INSTANTIATE_TEST_SUITE_P(
         TestState{std::vector<int>(100000), false}
     )
 );
+
+TEST(NodePoolTest, RecyclesFreedSlots) {
+    using Pool = Cutter::Lockfree::NodePool<Cutter::Lockfree::Node<int>>;
+    void* first = Pool::alloc();
+    Pool::free(first);
+    // The most recently freed slot is the first one handed back out.
+    ASSERT_EQ(first, Pool::alloc());
+    Pool::free(first);
+}
+
+TEST(ConcurrentQueueTest, MultiProducerMultiConsumer) {
+    constexpr int n_threads = 4;
+    constexpr int n_per_thread = 50000;
+    Cutter::Lockfree::Queue<int> q;
+    std::atomic<int> n_consumed(0);
+    std::vector<std::vector<int>> consumed(n_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&q, t] (void) {
+            for (int i = 0; i < n_per_thread; ++i) 
+                q.enqueue(t * n_per_thread + i);
+        });
+        threads.emplace_back([&q, &n_consumed, &consumed, t] (void) {
+            while (n_consumed.load() < n_threads * n_per_thread) {
+                auto elt = q.dequeue();
+                if (elt.has_value()) {
+                    consumed[t].push_back(*elt);
+                    ++n_consumed;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    // Every element should come out exactly once.
+    std::vector<int> output;
+    for (auto& c : consumed) output.insert(output.end(), c.begin(), c.end());
+    std::sort(output.begin(), output.end());
+    std::vector<int> expected(n_threads * n_per_thread);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(output, expected);
+    ASSERT_TRUE(q.empty());
+}
+
+TEST(ConcurrentQueueTest, SizeAndEmptySettleAfterConcurrentTraffic) {
+    constexpr int n_threads = 4;
+    constexpr int n_per_thread = 20000;
+    Cutter::Lockfree::Queue<int> q;
+    std::vector<std::thread> threads;
+
+    // Each thread leaves behind one element for every two it enqueues.
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&q] (void) {
+            for (int i = 0; i < n_per_thread; ++i) {
+                q.enqueue(i);
+                if (i % 2 == 0) 
+                    while (!q.dequeue().has_value()) continue;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    ASSERT_FALSE(q.empty());
+    ASSERT_EQ(q.size(), static_cast<size_t>(n_threads * n_per_thread / 2));
+    while (q.dequeue().has_value()) continue;
+    ASSERT_TRUE(q.empty());
+    ASSERT_EQ(q.size(), 0u);
+}
+
+TEST(RingBufferTest, ReportsFullAndEmpty) {
+    Cutter::Lockfree::RingBuffer<int, 8> rb;
+    ASSERT_FALSE(rb.try_dequeue().has_value());
+    for (int i = 0; i < 8; ++i) 
+        ASSERT_TRUE(rb.try_enqueue(i));
+    ASSERT_FALSE(rb.try_enqueue(8));
+    ASSERT_EQ(rb.size(), 8u);
+
+    // Go around the ring a few times to exercise the sequence numbers.
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(*rb.try_dequeue(), i);
+        ASSERT_TRUE(rb.try_enqueue(i + 8));
+    }
+    for (int i = 100; i < 108; ++i) 
+        ASSERT_EQ(*rb.try_dequeue(), i);
+    ASSERT_TRUE(rb.empty());
+}
+
+TEST(RingBufferTest, HoldsMoveOnlyTypes) {
+    Cutter::Lockfree::RingBuffer<std::unique_ptr<int>, 4> rb;
+    ASSERT_TRUE(rb.try_enqueue(std::make_unique<int>(42)));
+    auto out = rb.try_dequeue();
+    ASSERT_TRUE(out.has_value());
+    ASSERT_EQ(**out, 42);
+}
+
+// Built from an int, which has to be positive.
+struct Positive {
+    int n;
+    Positive(int x): n(x) {
+        if (x <= 0) throw std::invalid_argument("not positive");
+    }
+};
+
+TEST(RingBufferTest, ConstructorExceptionsReachTheCaller) {
+    static_assert(!noexcept(std::declval<Cutter::Lockfree::RingBuffer<Positive, 4>&>().try_enqueue(1)));
+    static_assert(noexcept(std::declval<Cutter::Lockfree::RingBuffer<int, 4>&>().try_enqueue(1)));
+    Cutter::Lockfree::RingBuffer<Positive, 4> rb;
+    ASSERT_TRUE(rb.try_enqueue(1));
+    ASSERT_THROW(rb.try_enqueue(-1), std::invalid_argument);
+    // Nothing was claimed for the bad one.
+    ASSERT_TRUE(rb.try_enqueue(2));
+    ASSERT_EQ(rb.try_dequeue()->n, 1);
+    ASSERT_EQ(rb.try_dequeue()->n, 2);
+    ASSERT_TRUE(rb.empty());
+
+    Cutter::Lockfree::SPSCQueue<Positive, 4> q;
+    ASSERT_THROW(q.enqueue(0), std::invalid_argument);
+    ASSERT_TRUE(q.empty());
+}
+
+// Copying one throws, moving one doesn't.
+struct Fragile {
+    int n;
+    Fragile(int x): n(x) {}
+    Fragile(const Fragile&) { throw std::runtime_error("copy"); }
+    Fragile(Fragile&& other) noexcept: n(other.n) {}
+};
+
+TEST(RingBufferTest, ThrowingCopiesLeaveTheRingUsable) {
+    Cutter::Lockfree::RingBuffer<Fragile, 2> rb;
+    const Fragile original(1);
+    for (int i = 0; i < 4; ++i) 
+        ASSERT_THROW(rb.try_enqueue(original), std::runtime_error);
+    ASSERT_TRUE(rb.empty());
+    // Nothing was left claimed and unfilled, so the ring still takes and gives back both its slots.
+    ASSERT_TRUE(rb.try_enqueue(Fragile(2)));
+    ASSERT_TRUE(rb.try_enqueue(Fragile(3)));
+    ASSERT_FALSE(rb.try_enqueue(Fragile(4)));
+    ASSERT_EQ(rb.try_dequeue()->n, 2);
+    ASSERT_EQ(rb.try_dequeue()->n, 3);
+}
+
+TEST(RingBufferTest, MultiProducerMultiConsumer) {
+    constexpr int n_threads = 4;
+    constexpr int n_per_thread = 50000;
+    Cutter::Lockfree::RingBuffer<int, 1024> rb;
+    std::atomic<int> n_consumed(0);
+    std::vector<std::vector<int>> consumed(n_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&rb, t] (void) {
+            for (int i = 0; i < n_per_thread; ++i) 
+                rb.enqueue(t * n_per_thread + i);
+        });
+        threads.emplace_back([&rb, &n_consumed, &consumed, t] (void) {
+            while (n_consumed.load() < n_threads * n_per_thread) {
+                auto elt = rb.try_dequeue();
+                if (elt.has_value()) {
+                    consumed[t].push_back(*elt);
+                    ++n_consumed;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::vector<int> output;
+    for (auto& c : consumed) output.insert(output.end(), c.begin(), c.end());
+    std::sort(output.begin(), output.end());
+    std::vector<int> expected(n_threads * n_per_thread);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(output, expected);
+}
+
+struct NoDefault {
+    int x;
+    explicit NoDefault(int v): x(v) { }
+};
+
+TEST(QueuePayloadTest, MovesOutMoveOnlyTypes) {
+    Cutter::Lockfree::Queue<std::unique_ptr<int>> q;
+    q.enqueue(std::make_unique<int>(7));
+    q.emplace(new int(8));
+    auto first = q.dequeue();
+    auto second = q.dequeue();
+    ASSERT_EQ(**first, 7);
+    ASSERT_EQ(**second, 8);
+    ASSERT_FALSE(q.dequeue().has_value());
+}
+
+TEST(QueuePayloadTest, HoldsNonDefaultConstructibleTypes) {
+    Cutter::Lockfree::Queue<NoDefault> q;
+    q.emplace(3);
+    q.enqueue(NoDefault(4));
+    ASSERT_EQ(q.dequeue()->x, 3);
+    ASSERT_EQ(q.dequeue()->x, 4);
+}
+
+TEST(QueuePayloadTest, DestroysRemainingValues) {
+    auto tracker = std::make_shared<int>(0);
+    {
+        Cutter::Lockfree::Queue<std::shared_ptr<int>> q;
+        for (int i = 0; i < 10; ++i) q.enqueue(tracker);
+        q.dequeue();
+        ASSERT_EQ(tracker.use_count(), 10);
+    }
+    ASSERT_EQ(tracker.use_count(), 1);
+}
+
+TEST(QueueBulkTest, BulkRoundTripPreservesOrder) {
+    Cutter::Lockfree::Queue<int> q;
+    std::vector<int> input(1000);
+    std::iota(input.begin(), input.end(), 0);
+    ASSERT_EQ(q.enqueue_bulk(input.begin(), input.end()), input.size());
+    q.enqueue(1000);
+
+    std::vector<int> output;
+    ASSERT_EQ(q.dequeue_bulk(std::back_inserter(output), 600), 600u);
+    ASSERT_EQ(q.dequeue_bulk(std::back_inserter(output), 600), 401u);
+    ASSERT_EQ(q.dequeue_bulk(std::back_inserter(output), 600), 0u);
+    input.push_back(1000);
+    ASSERT_EQ(output, input);
+    ASSERT_TRUE(q.empty());
+}
+
+TEST(QueueBulkTest, ConcurrentBulkProducersAndConsumers) {
+    constexpr int n_threads = 4;
+    constexpr int n_batches = 500;
+    constexpr int batch_size = 100;
+    constexpr int total = n_threads * n_batches * batch_size;
+    Cutter::Lockfree::Queue<int> q;
+    std::atomic<int> n_consumed(0);
+    std::vector<std::vector<int>> consumed(n_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&q, t] (void) {
+            std::vector<int> batch(batch_size);
+            for (int b = 0; b < n_batches; ++b) {
+                std::iota(batch.begin(), batch.end(), (t * n_batches + b) * batch_size);
+                q.enqueue_bulk(batch.begin(), batch.end());
+            }
+        });
+        threads.emplace_back([&q, &n_consumed, &consumed, t] (void) {
+            while (n_consumed.load() < total) {
+                // Alternate between bulk and single dequeues so the two paths race each other.
+                size_t n = q.dequeue_bulk(std::back_inserter(consumed[t]), 37);
+                auto elt = q.dequeue();
+                if (elt.has_value()) {
+                    consumed[t].push_back(*elt);
+                    ++n;
+                }
+                n_consumed += n;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::vector<int> output;
+    for (auto& c : consumed) output.insert(output.end(), c.begin(), c.end());
+    std::sort(output.begin(), output.end());
+    std::vector<int> expected(total);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(output, expected);
+}
+
+TEST(HazardPointerTest, SnapshotIsSortedAndSkipsEmptySlots) {
+    Cutter::Lockfree::HzdMemPool pool;
+    int objs[3];
+    std::vector<Cutter::Lockfree::Hzd*> hzds;
+    for (int i = 0; i < 4; ++i) hzds.push_back(pool.alloc());
+    **hzds[0] = &objs[2];
+    **hzds[1] = &objs[0];
+    **hzds[3] = &objs[1];
+
+    std::vector<void*> snapshot;
+    Cutter::Lockfree::snapshotHazards(pool.head(), snapshot);
+    std::vector<void*> expected{&objs[0], &objs[1], &objs[2]};
+    std::sort(expected.begin(), expected.end());
+    ASSERT_EQ(snapshot, expected);
+}
+
+TEST(EpochBasedTest, MultiProducerMultiConsumer) {
+    constexpr int n_threads = 4;
+    constexpr int n_per_thread = 50000;
+    Cutter::Lockfree::Queue<int, Cutter::Lockfree::EpochBased> q;
+    std::atomic<int> n_consumed(0);
+    std::vector<std::vector<int>> consumed(n_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&q, t] (void) {
+            for (int i = 0; i < n_per_thread; ++i) 
+                q.enqueue(t * n_per_thread + i);
+        });
+        threads.emplace_back([&q, &n_consumed, &consumed, t] (void) {
+            while (n_consumed.load() < n_threads * n_per_thread) {
+                // Hold one guard across a batch of dequeues, as a read-heavy consumer would.
+                Cutter::Lockfree::EpochBased::Guard guard;
+                for (int i = 0; i < 16; ++i) {
+                    auto elt = q.dequeue();
+                    if (elt.has_value()) {
+                        consumed[t].push_back(*elt);
+                        ++n_consumed;
+                    }
+                }
+            }
+            Cutter::Lockfree::EpochBased::quiesce();
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::vector<int> output;
+    for (auto& c : consumed) output.insert(output.end(), c.begin(), c.end());
+    std::sort(output.begin(), output.end());
+    std::vector<int> expected(n_threads * n_per_thread);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(output, expected);
+}
+
+TEST(EpochBasedTest, ReclaimsOnceEpochHasMovedTwice) {
+    static int n_reclaimed;
+    n_reclaimed = 0;
+    auto reclaim = [] (void*) { ++n_reclaimed; };
+    auto& domain = Cutter::Lockfree::EpochBased::domain();
+    int obj;
+
+    Cutter::Lockfree::EpochBased::retire(&obj, reclaim);
+    uint64_t start = domain.epoch();
+    Cutter::Lockfree::EpochBased::quiesce();
+    // A single pass can advance the epoch at most once, which is not enough yet.
+    ASSERT_EQ(n_reclaimed, 0);
+    while (domain.epoch() < start + 2) domain.tryAdvance();
+    Cutter::Lockfree::EpochBased::quiesce();
+    ASSERT_EQ(n_reclaimed, 1);
+}
+
+TEST(HazardPointerTest, ReleasedRecordsAreReused) {
+    Cutter::Lockfree::HzdMemPool pool;
+    Cutter::Lockfree::Hzd* a = pool.alloc();
+    Cutter::Lockfree::Hzd* b = pool.alloc();
+    ASSERT_EQ(pool.length(), 2u);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(a) % Cutter::Lockfree::CACHE_LINE_SIZE, 0u);
+
+    (*a)[1] = &pool;
+    Cutter::Lockfree::HzdMemPool::free(a);
+    // Releasing a record clears it, and the next thread to ask for one gets it back without growing the pool.
+    ASSERT_EQ((*a)[1].load(), nullptr);
+    ASSERT_EQ(pool.alloc(), a);
+    ASSERT_EQ(pool.length(), 2u);
+    Cutter::Lockfree::HzdMemPool::free(b);
+    Cutter::Lockfree::HzdMemPool::free(a);
+}
+
+TEST(HazardPointerTest, SnapshotCoversEverySlot) {
+    Cutter::Lockfree::HzdMemPool pool;
+    Cutter::Lockfree::Hzd* hzd = pool.alloc();
+    std::vector<int> objs(Cutter::Lockfree::HZD_SLOTS);
+    for (size_t i = 0; i < Cutter::Lockfree::HZD_SLOTS; ++i) 
+        (*hzd)[i] = &objs[i];
+
+    std::vector<void*> snapshot;
+    Cutter::Lockfree::snapshotHazards(pool.head(), snapshot);
+    ASSERT_EQ(snapshot.size(), Cutter::Lockfree::HZD_SLOTS);
+}
+
+TEST(StackTest, PushPopIsLastInFirstOut) {
+    Cutter::Lockfree::Stack<std::unique_ptr<int>> s;
+    ASSERT_TRUE(s.empty());
+    ASSERT_FALSE(s.pop().has_value());
+    s.push(std::make_unique<int>(1));
+    s.emplace(new int(2));
+    ASSERT_EQ(**s.pop(), 2);
+    ASSERT_EQ(**s.pop(), 1);
+    ASSERT_TRUE(s.empty());
+}
+
+TEST(StackTest, BulkPushAndPop) {
+    Cutter::Lockfree::Stack<int> s;
+    std::vector<int> input{1, 2, 3, 4, 5};
+    ASSERT_EQ(s.push_bulk(input.begin(), input.end()), 5u);
+    s.push(6);
+
+    std::vector<int> output;
+    ASSERT_EQ(s.pop_bulk(std::back_inserter(output), 4), 4u);
+    ASSERT_EQ(s.pop_bulk(std::back_inserter(output), 4), 2u);
+    ASSERT_EQ(output, std::vector<int>({6, 5, 4, 3, 2, 1}));
+    ASSERT_EQ(s.pop_bulk(std::back_inserter(output), 4), 0u);
+}
+
+TEST(StackTest, ConcurrentPushAndPop) {
+    constexpr int n_threads = 4;
+    constexpr int n_per_thread = 50000;
+    Cutter::Lockfree::Stack<int> s;
+    std::atomic<int> n_consumed(0);
+    std::vector<std::vector<int>> consumed(n_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&s, t] (void) {
+            for (int i = 0; i < n_per_thread; ++i) 
+                s.push(t * n_per_thread + i);
+        });
+        threads.emplace_back([&s, &n_consumed, &consumed, t] (void) {
+            while (n_consumed.load() < n_threads * n_per_thread) {
+                size_t n = s.pop_bulk(std::back_inserter(consumed[t]), 8);
+                auto elt = s.pop();
+                if (elt.has_value()) {
+                    consumed[t].push_back(*elt);
+                    ++n;
+                }
+                n_consumed += n;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::vector<int> output;
+    for (auto& c : consumed) output.insert(output.end(), c.begin(), c.end());
+    std::sort(output.begin(), output.end());
+    std::vector<int> expected(n_threads * n_per_thread);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(output, expected);
+}
+
+TEST(SPSCQueueTest, ReportsFullAndEmpty) {
+    Cutter::Lockfree::SPSCQueue<std::unique_ptr<int>, 4> q;
+    ASSERT_FALSE(q.try_dequeue().has_value());
+    for (int i = 0; i < 4; ++i) 
+        ASSERT_TRUE(q.try_enqueue(std::make_unique<int>(i)));
+    ASSERT_FALSE(q.try_enqueue(std::make_unique<int>(4)));
+    ASSERT_EQ(q.size(), 4u);
+    for (int i = 0; i < 4; ++i) 
+        ASSERT_EQ(**q.try_dequeue(), i);
+    ASSERT_TRUE(q.empty());
+}
+
+TEST(SPSCQueueTest, OneProducerOneConsumer) {
+    constexpr int n = 200000;
+    Cutter::Lockfree::SPSCQueue<int, 256> q;
+    std::vector<int> output;
+    std::thread producer([&q] (void) {
+        for (int i = 0; i < n; ++i) q.enqueue(i);
+    });
+    while (output.size() < n) {
+        auto elt = q.dequeue();
+        if (elt.has_value()) output.push_back(*elt);
+    }
+    producer.join();
+
+    std::vector<int> expected(n);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(output, expected);
+}
+
+TEST(DequeueWaitTest, TimesOutOnEmptyQueue) {
+    using namespace std::chrono;
+    Cutter::Lockfree::Queue<int> q;
+    auto start = steady_clock::now();
+    ASSERT_FALSE(q.dequeue_wait(milliseconds(50)).has_value());
+    ASSERT_GE(steady_clock::now() - start, milliseconds(40));
+}
+
+TEST(DequeueWaitTest, ParkedConsumersAreWokenByProducers) {
+    using namespace std::chrono;
+    constexpr int n_consumers = 4;
+    constexpr int n_items = 4000;
+    Cutter::Lockfree::Queue<int> q;
+    std::atomic<int> n_consumed(0);
+    std::vector<std::thread> consumers;
+    auto start = steady_clock::now();
+    for (int c = 0; c < n_consumers; ++c) {
+        consumers.emplace_back([&q, &n_consumed] (void) {
+            // The timeout is far longer than the test should take, so only a wakeup gets us out in time.
+            while (true) {
+                auto elt = q.dequeue_wait(seconds(10));
+                if (!elt.has_value()) continue;
+                if (*elt < 0) break;
+                ++n_consumed;
+            }
+        });
+    }
+    // Give the consumers time to park, then trickle the elements in.  A negative element tells a consumer to quit.
+    std::this_thread::sleep_for(milliseconds(50));
+    for (int i = 0; i < n_items; ++i) {
+        q.enqueue(i);
+        if (i % 100 == 0) std::this_thread::sleep_for(microseconds(100));
+    }
+    for (int c = 0; c < n_consumers; ++c) q.enqueue(-1);
+    for (auto& consumer : consumers) consumer.join();
+    ASSERT_EQ(n_consumed.load(), n_items);
+    ASSERT_TRUE(q.empty());
+    ASSERT_LT(steady_clock::now() - start, seconds(5));
+}
+
+TEST(DequeueWaitTest, OneEventCountCoversSeveralQueues) {
+    using namespace std::chrono;
+    Cutter::Lockfree::EventCount idle;
+    Cutter::Lockfree::Queue<int> mpmc(&idle);
+    Cutter::Lockfree::SPSCQueue<int, 16> spsc(&idle);
+    std::atomic<int> total(0);
+    auto start = steady_clock::now();
+    std::thread consumer([&] (void) {
+        int seen = 0;
+        while (seen < 2) {
+            std::optional<int> elt = mpmc.dequeue();
+            if (!elt) elt = spsc.dequeue();
+            if (elt) {
+                total += *elt;
+                ++seen;
+                continue;
+            }
+            uint32_t key = idle.prepareWait();
+            if (!mpmc.empty() || !spsc.empty()) {
+                idle.cancelWait();
+                continue;
+            }
+            // No timeout, so only the queues' notifications get us out.
+            idle.wait(key);
+        }
+    });
+    std::this_thread::sleep_for(milliseconds(50));
+    spsc.enqueue(1);
+    std::this_thread::sleep_for(milliseconds(50));
+    mpmc.enqueue(2);
+    consumer.join();
+    ASSERT_EQ(total.load(), 3);
+    ASSERT_LT(steady_clock::now() - start, seconds(5));
+}
+
+TEST(StealingDequeTest, OwnerPopsNewestThievesStealOldest) {
+    Cutter::Lockfree::StealingDeque<int> dq(2);
+    ASSERT_FALSE(dq.pop().has_value());
+    ASSERT_FALSE(dq.steal().has_value());
+    // Pushing past the initial capacity makes it grow.
+    for (int i = 0; i < 100; ++i) 
+        dq.push(i);
+    ASSERT_EQ(dq.size(), 100u);
+    ASSERT_EQ(*dq.steal(), 0);
+    ASSERT_EQ(*dq.pop(), 99);
+    ASSERT_EQ(*dq.steal(), 1);
+    for (int i = 98; i >= 2; --i) 
+        ASSERT_EQ(*dq.pop(), i);
+    ASSERT_TRUE(dq.empty());
+}
+
+TEST(StealingDequeTest, EveryElementIsTakenExactlyOnce) {
+    constexpr int n = 200000;
+    constexpr int n_thieves = 4;
+    Cutter::Lockfree::StealingDeque<int> dq(16);
+    std::atomic<bool> done(false);
+    std::vector<std::vector<int>> stolen(n_thieves);
+    std::vector<std::thread> thieves;
+    for (int t = 0; t < n_thieves; ++t) {
+        thieves.emplace_back([&, t] (void) {
+            while (!done.load() || !dq.empty()) {
+                auto elt = dq.steal();
+                if (elt.has_value()) stolen[t].push_back(*elt);
+            }
+        });
+    }
+    // The owner pushes everything, and pops some of it back as it goes, racing the thieves for the last element.
+    std::vector<int> popped;
+    for (int i = 0; i < n; ++i) {
+        dq.push(i);
+        if (i % 3 == 0) {
+            auto elt = dq.pop();
+            if (elt.has_value()) popped.push_back(*elt);
+        }
+    }
+    done = true;
+    for (auto& thief : thieves) thief.join();
+
+    std::vector<int> all(popped);
+    for (auto& s : stolen) all.insert(all.end(), s.begin(), s.end());
+    std::sort(all.begin(), all.end());
+    std::vector<int> expected(n);
+    std::iota(expected.begin(), expected.end(), 0);
+    ASSERT_EQ(all, expected);
+}
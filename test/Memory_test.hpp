@@ -178,6 +178,297 @@ TEST(ObjectPoolTest, MultithreadedAllocMultiBuffer) {
     }
     ASSERT_EQ(results, expected_results);
 }
+
+TEST(ObjectPoolTest, FreedObjectsStayWithTheThread) {
+    ObjectPool<int> pool;
+    std::vector<int*> ptrs;
+    for (size_t i = 0; i < MAGAZINE_SIZE; ++i) 
+        ptrs.push_back(pool.alloc());
+    for (int* ptr : ptrs) 
+        pool.free(ptr);
+    // A full magazine's worth fits without touching the shared free list...
+    ASSERT_TRUE(pool.free_.empty());
+    // ...and comes back out most recently freed first.
+    for (auto it = ptrs.rbegin(); it != ptrs.rend(); ++it) 
+        ASSERT_EQ(pool.alloc(), *it);
+
+    // Past that, half the magazine spills over to the shared list, where other threads can pick it up.
+    int* extra = pool.alloc();
+    for (int* ptr : ptrs) 
+        pool.free(ptr);
+    pool.free(extra);
+    ASSERT_FALSE(pool.free_.empty());
+    std::unordered_set<int*> seen;
+    std::thread other([&pool, &seen] (void) {
+        for (size_t i = 0; i < MAGAZINE_SIZE / 2; ++i) 
+            seen.insert(pool.alloc());
+    });
+    other.join();
+    ASSERT_EQ(seen.size(), MAGAZINE_SIZE / 2);
+    for (size_t i = 0; i < MAGAZINE_SIZE / 2; ++i) 
+        ASSERT_TRUE(seen.count(ptrs[i]));
+}
+
+TEST(ObjectPoolTest, GeometricGrowthIsCapped) {
+    ObjectPool<int> pool(16, Growth::Geometric, 64);
+    size_t n_allocs = 0;
+    for (size_t size : {16, 32, 64, 64}) {
+        // Let the background refill land first, so that every block comes from it.
+        while (pool.refilling_.load()) std::this_thread::yield();
+        for (size_t i = 0; i < size; ++i, ++n_allocs) 
+            pool.alloc();
+    }
+    ASSERT_EQ(pool.block_sizes_, std::vector<size_t>({16, 32, 64, 64, 64}));
+    ASSERT_EQ(pool.blocks_.size(), 5u);
+}
+
+TEST(ObjectPoolTest, PreallocatedBlocksAreUsedFirst) {
+    ObjectPool<int> pool(16, Growth::Fixed, MAX_BLOCK_SIZE, 64);
+    ASSERT_EQ(pool.spare_.size(), 3u);
+    std::vector<int*> spares;
+    for (auto it = pool.spare_.rbegin(); it != pool.spare_.rend(); ++it) 
+        spares.push_back(it->first);
+    // Everything up to the last object of the last preallocated block comes out of memory we already have.
+    for (int i = 0; i < 63; ++i) 
+        pool.alloc();
+    ASSERT_TRUE(pool.spare_.empty());
+    ASSERT_EQ(std::vector<int*>(pool.blocks_.begin() + 1, pool.blocks_.end()), spares);
+}
+
+struct Counted {
+    static inline int alive = 0;
+    int value;
+    explicit Counted(int v): value(v) { ++alive; }
+    ~Counted(void) { --alive; }
+};
+
+TEST(ObjectPoolTest, ConstructsOnlyWhatIsAllocated) {
+    {
+        ObjectPool<Counted> pool;
+        // Counted has no default constructor, and nothing is built until it's asked for.
+        ASSERT_EQ(Counted::alive, 0);
+        Counted* a = pool.alloc(1);
+        Counted* b = pool.alloc(2);
+        ASSERT_EQ(Counted::alive, 2);
+        ASSERT_EQ(a->value, 1);
+        pool.free(a);
+        ASSERT_EQ(Counted::alive, 1);
+        // A cleaned object is still alive, and the pool destroys it when it goes.
+        pool.clean(b);
+        ASSERT_EQ(Counted::alive, 1);
+    }
+    ASSERT_EQ(Counted::alive, 0);
+}
+
+TEST(ObjectPoolTest, CleanedObjectsAreResetAndReused) {
+    ObjectPool<std::string> pool;
+    std::string* str = pool.alloc("a string too long to fit in the small string buffer");
+    size_t capacity = str->capacity();
+    pool.clean(str);
+    ASSERT_EQ(pool.alloc(), str);
+    ASSERT_EQ(*str, "");
+    ASSERT_EQ(str->capacity(), capacity);
+    pool.free(str);
+    str = pool.alloc();
+    ASSERT_EQ(*str, "");
+    pool.free(str);
+}
+
+// Looks enough like a protobuf message for Reset to treat it as one.
+struct FakeMessage {
+    std::vector<int> field;
+    int clears = 0;
+    void Clear(void) { field.clear(); ++clears; }
+    void clear(void) { ADD_FAILURE() << "Clear() should win over clear()"; }
+};
+
+struct Sticky { int value; };
+
+template<>
+struct Reset<Sticky> {
+    static void reset(Sticky& obj) { obj.value = -1; }
+};
+
+TEST(ObjectPoolTest, CleanUsesTheResetTrait) {
+    ObjectPool<FakeMessage> messages;
+    FakeMessage* msg = messages.alloc();
+    msg->field.assign(100, 1);
+    messages.clean(msg);
+    ASSERT_EQ(messages.alloc(), msg);
+    ASSERT_TRUE(msg->field.empty());
+    ASSERT_GE(msg->field.capacity(), 100u);
+    ASSERT_EQ(msg->clears, 1);
+    messages.free(msg);
+
+    ObjectPool<Sticky> sticky;
+    Sticky* obj = sticky.alloc(Sticky{5});
+    sticky.clean(obj);
+    ASSERT_EQ(sticky.alloc(), obj);
+    ASSERT_EQ(obj->value, -1);
+    sticky.free(obj);
+}
+
+TEST(ObjectPoolTest, TrimReleasesOnlyEmptyBlocks) {
+    ObjectPool<int> pool(16);
+    std::vector<int*> ptrs;
+    for (int i = 0; i < 65; ++i) 
+        ptrs.push_back(pool.alloc());
+    ASSERT_EQ(pool.blocks_.size(), 5u);
+    // The first two blocks come back whole, the third only half.
+    for (int i = 0; i < 40; ++i) 
+        pool.free(ptrs[i]);
+    auto before = pool.stats();
+    ASSERT_EQ(before.live, 25u);
+    ASSERT_EQ(before.cached, 40u);
+    ASSERT_EQ(before.capacity, 80u);
+
+    ASSERT_EQ(pool.trim(), 32u);
+    ASSERT_EQ(pool.blocks_.size(), 3u);
+    ASSERT_EQ(pool.blocks_[0], ptrs[32]);
+    auto after = pool.stats();
+    ASSERT_EQ(after.live, 25u);
+    ASSERT_EQ(after.cached, 8u);
+    ASSERT_EQ(after.capacity, 48u);
+    ASSERT_EQ(pool.trim(), 0u);
+}
+
+TEST(ObjectPoolTest, HighWatermarkTrimsOnFree) {
+    ObjectPool<int> pool(16);
+    pool.setHighWatermark(32);
+    std::vector<int*> ptrs;
+    for (int i = 0; i < 129; ++i) 
+        ptrs.push_back(pool.alloc());
+    ASSERT_EQ(pool.blocks_.size(), 9u);
+    // The second spill from the magazine puts 64 objects, the first four blocks, on the shared list.  That's over
+    // the watermark, so the first three blocks go and the fourth is kept.
+    for (int i = 0; i < 128; ++i) 
+        pool.free(ptrs[i]);
+    ASSERT_EQ(pool.blocks_.size(), 6u);
+    ASSERT_EQ(pool.blocks_[0], ptrs[48]);
+    auto stats = pool.stats();
+    ASSERT_EQ(stats.live, 1u);
+    ASSERT_EQ(stats.cached, 80u);
+    ASSERT_EQ(stats.capacity, 96u);
+}
+
+TEST(ArenaTest, ReusesReleasedRanges) {
+    Arena arena(1 << 24);
+    char* a = static_cast<char*>(arena.allocate(10000));
+    char* b = static_cast<char*>(arena.allocate(1));
+    ASSERT_TRUE(arena.owns(a));
+    ASSERT_TRUE(arena.owns(b));
+    ASSERT_FALSE(arena.owns(&arena));
+    // Everything is rounded up to whole pages.
+    ASSERT_EQ(std::distance(a, b) % sysconf(_SC_PAGESIZE), 0);
+    arena.deallocate(a, 10000);
+    ASSERT_EQ(arena.allocate(1), a);
+    ASSERT_EQ(arena.allocate(1), a + sysconf(_SC_PAGESIZE));
+}
+
+TEST(ArenaTest, GrowsByReservingMoreRegions) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    Arena arena(4 * page);
+    char* a = static_cast<char*>(arena.allocate(3 * page));
+    // Doesn't fit in what's left of the first region, nor in a region of the usual size.
+    char* b = static_cast<char*>(arena.allocate(8 * page));
+    ASSERT_TRUE(arena.owns(a));
+    ASSERT_TRUE(arena.owns(b));
+    ASSERT_TRUE(arena.owns(b + 8 * page - 1));
+    b[8 * page - 1] = 1;
+    // The first region's last page is still used.
+    ASSERT_EQ(arena.allocate(page), a + 3 * page);
+}
+
+TEST(ArenaTest, HugePagesFallBackGracefully) {
+    size_t huge = Arena::hugePageSize();
+    // Whether or not the machine has huge pages to give, the arena works and hands out whole huge pages.
+    Arena arena(4 * huge, Numa::ANY, Pages::Huge);
+    ASSERT_EQ(arena.granule(), huge);
+    char* a = static_cast<char*>(arena.allocate(1));
+    char* b = static_cast<char*>(arena.allocate(1));
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(a) % huge, 0u);
+    ASSERT_EQ(std::distance(a, b), static_cast<ptrdiff_t>(huge));
+    a[0] = 1;
+    b[huge - 1] = 2;
+    arena.deallocate(a, 1);
+    ASSERT_EQ(arena.allocate(huge), a);
+    ASSERT_EQ(Arena(1 << 24).pages(), Pages::Normal);
+}
+
+TEST(ArenaTest, QueueNodesComeFromTheNodeArena) {
+    // A type of its own, so that its node pool is empty and has to grow.
+    struct Record { int64_t id; };
+    NodeArena::install(Pages::Transparent, 1 << 26);
+    void* slot = Cutter::Lockfree::NodePool<Cutter::Lockfree::Node<Record>>::alloc();
+    ASSERT_TRUE(NodeArena::owns(slot));
+    Cutter::Lockfree::NodePool<Cutter::Lockfree::Node<Record>>::free(slot);
+    Cutter::Lockfree::Queue<Record> q;
+    for (int64_t i = 0; i < 1000; ++i) 
+        q.enqueue(Record{i});
+    for (int64_t i = 0; i < 1000; ++i) 
+        ASSERT_EQ(q.dequeue()->id, i);
+}
+
+TEST(ObjectPoolTest, BlocksComeFromTheArena) {
+    Arena arena(1 << 24);
+    {
+        ObjectPool<int> pool(16, Growth::Fixed, MAX_BLOCK_SIZE, 0, &arena);
+        std::vector<int*> ptrs;
+        for (int i = 0; i < 33; ++i) 
+            ptrs.push_back(pool.alloc());
+        for (int* ptr : ptrs) 
+            ASSERT_TRUE(arena.owns(ptr));
+        for (int i = 0; i < 16; ++i) 
+            pool.free(ptrs[i]);
+        ASSERT_EQ(pool.trim(), 16u);
+    }
+    // The trimmed block's pages are the first to be handed out again.
+    ASSERT_TRUE(arena.owns(arena.allocate(1)));
+}
+
+TEST(ObjectPoolTest, NumaPoolSendsObjectsHome) {
+    NumaObjectPool<int> pool(16, Growth::Fixed, MAX_BLOCK_SIZE, 0, 1 << 24);
+    ASSERT_EQ(pool.pools_.size(), Numa::nodes());
+    int* ptr = pool.alloc(7);
+    ASSERT_TRUE(pool.arenas_[Numa::node()]->owns(ptr));
+    // Freed somewhere else, it still goes back to the pool it came from.
+    std::thread other([&pool, ptr] (void) { pool.free(ptr); });
+    other.join();
+    auto stats = pool.stats();
+    ASSERT_EQ(stats.live, 0u);
+    ASSERT_EQ(stats.cached, 1u);
+    ASSERT_EQ(stats.capacity, 16u * Numa::nodes());
+}
+
+TEST(HandlePoolTest, StaleHandlesAreRejected) {
+    HandlePool<std::pair<int, int>> pool(16);
+    Handle<std::pair<int, int>> first = pool.alloc(1, 2);
+    ASSERT_EQ(pool.get(first)->second, 2);
+    ASSERT_TRUE(pool.free(first));
+    ASSERT_EQ(pool.get(first), nullptr);
+    ASSERT_FALSE(pool.free(first));
+    // The slot is reused, but under a new generation.
+    Handle<std::pair<int, int>> second = pool.alloc(3, 4);
+    ASSERT_NE(first, second);
+    ASSERT_EQ(pool.get(first), nullptr);
+    ASSERT_EQ(pool.get(second)->first, 3);
+    ASSERT_EQ(pool.get(Handle<std::pair<int, int>>()), nullptr);
+    ASSERT_EQ(pool.stats().live, 1u);
+}
+
+TEST(HandlePoolTest, PoisonCatchesWritesAfterFree) {
+    HandlePool<int64_t> pool(16, Growth::Fixed, MAX_BLOCK_SIZE, 0, nullptr, true);
+    Handle<int64_t> handle = pool.alloc(7);
+    int64_t* stale = pool.get(handle);
+    pool.free(handle);
+    ASSERT_NE(*stale, 7);
+    *stale = 7;
+    ASSERT_THROW(pool.alloc(8), std::logic_error);
+    // The slot was put back poisoned, so it can be used again.
+    Handle<int64_t> again = pool.alloc(8);
+    ASSERT_EQ(pool.get(again), stale);
+}
+
 INSTANTIATE_TEST_SUITE_P(
     Default, 
     ObjectPoolTest,
@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../src/Parallel.hpp"
+
+namespace Cutter::Proletariat {
+
+struct ParallelTest: public testing::TestWithParam<Scheduling> {
+    Pool pool;
+    ParallelTest(): pool(4, GetParam()) { pool.start(); }
+};
+
+TEST_P(ParallelTest, ForVisitsEveryIndexOnce) {
+    std::vector<std::atomic<int>> visits(100003);
+    parallel_for(pool, 0, 100003, 64, [&] (int i) { ++visits[i]; });
+    ASSERT_TRUE(std::all_of(visits.begin(), visits.end(), [] (auto& v) { return v.load() == 1; }));
+    // Empty ranges do nothing.
+    parallel_for(pool, 5, 5, 1, [] (int) { FAIL(); });
+}
+
+TEST_P(ParallelTest, ReduceMatchesSerial) {
+    int64_t sum = parallel_reduce(
+        pool, int64_t(0), int64_t(1000000), 1000, int64_t(0), 
+        [] (int64_t i) { return i * i; }, 
+        [] (int64_t a, int64_t b) { return a + b; }
+    );
+    int64_t expected = 0;
+    for (int64_t i = 0; i < 1000000; ++i) expected += i * i;
+    ASSERT_EQ(sum, expected);
+}
+
+TEST_P(ParallelTest, TransformWritesEveryOutput) {
+    std::vector<int> in(50000);
+    std::iota(in.begin(), in.end(), 0);
+    std::vector<std::string> out(in.size());
+    auto end = parallel_transform(pool, in.begin(), in.end(), out.begin(), 128, [] (int x) { 
+        return std::to_string(x); 
+    });
+    ASSERT_EQ(end, out.end());
+    for (size_t i = 0; i < in.size(); ++i) 
+        ASSERT_EQ(out[i], std::to_string(i));
+}
+
+TEST_P(ParallelTest, SortMatchesStdSort) {
+    std::mt19937 gen(7);
+    std::vector<int> v(300007);
+    for (auto& x : v) x = gen() % 1000;
+    std::vector<int> expected(v);
+    std::sort(expected.begin(), expected.end());
+    parallel_sort(pool, v.begin(), v.end());
+    ASSERT_EQ(v, expected);
+
+    // Stable: equal keys keep their original order.
+    std::vector<std::pair<int, int>> pairs(100000);
+    for (int i = 0; i < 100000; ++i) pairs[i] = {static_cast<int>(gen() % 100), i};
+    auto by_key = [] (const auto& a, const auto& b) { return a.first < b.first; };
+    std::vector<std::pair<int, int>> stable_expected(pairs);
+    std::stable_sort(stable_expected.begin(), stable_expected.end(), by_key);
+    parallel_sort(pool, pairs.begin(), pairs.end(), by_key, true);
+    ASSERT_EQ(pairs, stable_expected);
+}
+
+TEST_P(ParallelTest, ExceptionsReachTheCaller) {
+    std::atomic<int> n_run(0);
+    ASSERT_THROW(
+        parallel_for(pool, 0, 10000, 10, [&] (int i) { 
+            ++n_run;
+            if (i == 5000) throw std::runtime_error("bad record"); 
+        }),
+        std::runtime_error
+    );
+    ASSERT_GT(n_run.load(), 0);
+}
+
+// Loops started from inside a task help themselves rather than wait on workers that are all busy.
+TEST_P(ParallelTest, NestedLoopsDoNotDeadlock) {
+    std::atomic<int64_t> total(0);
+    parallel_for(pool, 0, 16, 1, [&] (int) {
+        total += parallel_reduce(
+            pool, 0, 1000, 10, int64_t(0), 
+            [] (int i) { return int64_t(i); }, 
+            [] (int64_t a, int64_t b) { return a + b; }
+        );
+    });
+    ASSERT_EQ(total.load(), 16 * 499500);
+}
+
+TEST(ParallelTest, RunsOnTheCallerWhenThePoolIsNotStarted) {
+    Pool pool(4);
+    int64_t sum = parallel_reduce(
+        pool, 0, 100, 1, int64_t(0), 
+        [] (int i) { return int64_t(i); }, 
+        [] (int64_t a, int64_t b) { return a + b; }
+    );
+    ASSERT_EQ(sum, 4950);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Schedulings, 
+    ParallelTest, 
+    testing::Values(Scheduling::Shared, Scheduling::Stealing)
+);
+
+}
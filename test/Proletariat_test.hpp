@@ -0,0 +1,345 @@
+#include <gtest/gtest.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../src/Proletariat.hpp"
+
+namespace Cutter::Proletariat {
+
+struct PoolTest: public testing::TestWithParam<Scheduling> {};
+
+// Blocks until pred holds, or gives up after a while so that a broken pool fails the test instead of hanging it.
+inline bool eventually(const std::function<bool()>& pred) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() > deadline) 
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+// Holds the pool's only worker up until it's opened, so that a backlog can be lined up behind it.
+struct Gate {
+    std::atomic<bool> open{false};
+    std::atomic<bool> held{false};
+    void hold(Pool& pool) {
+        pool.post([this] (void) {
+            held = true;
+            eventually([this] { return open.load(); });
+        });
+        eventually([this] { return held.load(); });
+    }
+};
+
+TEST_P(PoolTest, RunsEverythingSubmittedFromOutside) {
+    Pool pool(4, GetParam());
+    std::atomic<int> n_run(0);
+    pool.start();
+    for (int i = 0; i < 10000; ++i) 
+        pool.submit([&n_run] (void) { ++n_run; });
+    ASSERT_TRUE(eventually([&] { return n_run.load() == 10000; }));
+    pool.stop();
+}
+
+// Every task splits in two until the pieces are small enough, like splitting a file into chunks to parse.
+TEST_P(PoolTest, RunsRecursiveFanOut) {
+    Pool pool(4, GetParam());
+    std::atomic<int> n_leaves(0);
+    std::function<void(int)> split = [&] (int n) {
+        if (n == 1) {
+            ++n_leaves;
+            return;
+        }
+        pool.submit(split, n / 2);
+        pool.submit(split, n - n / 2);
+    };
+    pool.start();
+    pool.submit(split, 1 << 14);
+    ASSERT_TRUE(eventually([&] { return n_leaves.load() == 1 << 14; }));
+    pool.stop();
+}
+
+TEST(PoolTest, WorkersStealFromEachOther) {
+    Pool pool(4, Scheduling::Stealing);
+    std::atomic<int> n_run(0);
+    std::atomic<std::thread::id> first_runner;
+    std::thread::id owner;
+    pool.start();
+    // One task puts everything on its own worker's deque, and then holds that worker up until something has run.
+    // Whatever ran first must have been stolen.
+    pool.submit([&] (void) {
+        owner = std::this_thread::get_id();
+        for (int i = 0; i < 1000; ++i) {
+            pool.submit([&] (void) {
+                if (n_run++ == 0) first_runner = std::this_thread::get_id();
+            });
+        }
+        eventually([&] { return n_run.load() > 0; });
+    });
+    ASSERT_TRUE(eventually([&] { return n_run.load() == 1000; }));
+    pool.stop();
+    ASSERT_NE(first_runner.load(), owner);
+}
+
+TEST_P(PoolTest, SubmitHandsBackResults) {
+    Pool pool(4, GetParam());
+    pool.start();
+    std::vector<std::future<int>> squares;
+    for (int i = 0; i < 100; ++i) 
+        squares.push_back(pool.submit([] (int x) { return x * x; }, i));
+    for (int i = 0; i < 100; ++i) 
+        ASSERT_EQ(squares[i].get(), i * i);
+    // Move only arguments and results are fine.
+    auto moved = pool.submit([] (std::unique_ptr<int> p) { return p; }, std::make_unique<int>(7));
+    ASSERT_EQ(*moved.get(), 7);
+    auto thrown = pool.submit([] (void) { throw std::runtime_error("oops"); });
+    ASSERT_THROW(thrown.get(), std::runtime_error);
+    pool.stop();
+}
+
+TEST(PoolTest, SubmitBeforeStartOrAfterStopIsRefused) {
+    Pool pool(1);
+    ASSERT_FALSE(pool.submit([] (void) { return 1; }).valid());
+    ASSERT_FALSE(pool.post([] (void) {}));
+    pool.start();
+    pool.stop();
+    ASSERT_FALSE(pool.submit([] (void) { return 1; }).valid());
+    ASSERT_FALSE(pool.post([] (void) {}));
+}
+
+TEST(TaskTest, SmallCallablesAreStoredInline) {
+    const void* where = nullptr;
+    int64_t captured = 5;
+    Task task([&where, captured] (void) { where = &captured; });
+    Task moved(std::move(task));
+    ASSERT_FALSE(task);
+    moved();
+    auto bytes = reinterpret_cast<const char*>(&moved);
+    ASSERT_TRUE(where >= bytes && where < bytes + sizeof(Task));
+
+    // Too big to fit, so it goes on the heap, and still survives being moved around.
+    std::array<int64_t, 16> big{};
+    big[15] = 42;
+    int64_t seen = 0;
+    Task boxed([&seen, big] (void) { seen = big[15]; });
+    Task other;
+    other = std::move(boxed);
+    other();
+    ASSERT_EQ(seen, 42);
+}
+
+// The only allocation a plain submit makes is for the future.
+TEST(TaskTest, SubmittedTasksAreStoredInline) {
+    auto job = Pool::deliver(std::promise<int>(), [] (void) { return 1; });
+    ASSERT_TRUE(Task::fits<decltype(job)>);
+    auto with_args = Pool::deliver(std::promise<int>(), [] (int x, int y) { return x + y; }, 1, 2);
+    ASSERT_TRUE(Task::fits<decltype(with_args)>);
+}
+
+TEST(TaskTest, HoldsMoveOnlyCallables) {
+    int seen = 0;
+    Task task([&seen, p = std::make_unique<int>(3)] (void) { seen = *p; });
+    task();
+    ASSERT_EQ(seen, 3);
+}
+
+TEST_P(PoolTest, StopWaitsForRunningTasks) {
+    Pool pool(4, GetParam());
+    std::atomic<int> n_done(0);
+    pool.start();
+    for (int i = 0; i < 8; ++i) {
+        pool.post([&] (void) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            // Tasks scheduled by tasks count too.
+            pool.post([&n_done] (void) { ++n_done; });
+        });
+    }
+    pool.stop(true);
+    ASSERT_EQ(n_done.load(), 8);
+}
+
+TEST_P(PoolTest, ThrowingPostedTasksAreReportedAndFinish) {
+    Pool pool(2, GetParam());
+    std::atomic<int> n_errors(0);
+    pool.onError([&n_errors] (std::exception_ptr error) {
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (const std::runtime_error&) {
+            ++n_errors;
+        }
+    });
+    pool.start();
+    std::atomic<int> n_run(0);
+    for (int i = 0; i < 10; ++i) {
+        pool.post([] (void) { throw std::runtime_error("bad record"); });
+        pool.post([&n_run] (void) { ++n_run; });
+    }
+    pool.stop(true);
+    ASSERT_EQ(n_errors.load(), 10);
+    ASSERT_EQ(n_run.load(), 10);
+}
+
+TEST_P(PoolTest, StopBreaksThePromisesOfWaitingTasks) {
+    Pool pool(1, GetParam());
+    pool.start();
+    Gate gate;
+    gate.hold(pool);
+    auto stranded = pool.submit([] (void) { return 1; });
+    TaskGroup group(pool);
+    group.run([] (void) {});
+    std::thread opener([&gate] (void) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        gate.open = true;
+    });
+    pool.stop();
+    opener.join();
+    ASSERT_THROW(stranded.get(), std::future_error);
+    ASSERT_THROW(group.wait(), std::future_error);
+}
+
+TEST_P(PoolTest, TaskGroupWaitsAndHelps) {
+    // One worker, which the group's own tasks keep busy, so the waiting thread has to pitch in.
+    Pool pool(1, GetParam());
+    pool.start();
+    std::atomic<int> n_run(0);
+    TaskGroup outer(pool);
+    outer.run([&] (void) {
+        TaskGroup inner(pool);
+        for (int i = 0; i < 100; ++i) 
+            inner.run([&n_run] (int k) { n_run += k; }, 1);
+        inner.wait();
+    });
+    outer.wait();
+    ASSERT_EQ(n_run.load(), 100);
+
+    outer.run([] (void) { throw std::runtime_error("bad batch"); });
+    ASSERT_THROW(outer.wait(), std::runtime_error);
+    // The error has been reported, and the group is good to go again.
+    outer.run([&n_run] (void) { ++n_run; });
+    outer.wait();
+    ASSERT_EQ(n_run.load(), 101);
+    pool.stop();
+}
+
+TEST_P(PoolTest, GraphRunsNodesAfterTheirPredecessors) {
+    Pool pool(4, GetParam());
+    pool.start();
+    std::atomic<int> clock(0);
+    std::vector<int> finished_at(5, -1);
+    auto stamp = [&] (int node) { return [&, node] (void) { finished_at[node] = clock++; }; };
+    // 2 waits for 0 and 1, 3 waits for 1, and 4 waits for 2 and 3.
+    TaskGraph graph(pool);
+    auto a = graph.add(stamp(0));
+    auto b = graph.add(stamp(1));
+    auto c = graph.add(stamp(2), {a, b});
+    auto d = graph.add(stamp(3), {b});
+    graph.add(stamp(4), {c, d});
+    for (int round = 0; round < 3; ++round) {
+        graph.run();
+        graph.wait();
+        ASSERT_LT(finished_at[0], finished_at[2]);
+        ASSERT_LT(finished_at[1], finished_at[2]);
+        ASSERT_LT(finished_at[1], finished_at[3]);
+        ASSERT_LT(finished_at[2], finished_at[4]);
+        ASSERT_LT(finished_at[3], finished_at[4]);
+    }
+    ASSERT_EQ(clock.load(), 15);
+    pool.stop();
+}
+
+TEST_P(PoolTest, GraphSkipsWhatComesAfterAFailure) {
+    Pool pool(2, GetParam());
+    pool.start();
+    std::atomic<int> n_run(0);
+    TaskGraph graph(pool);
+    auto first = graph.add([] (void) { throw std::runtime_error("bad stage"); });
+    graph.add([&n_run] (void) { ++n_run; }, {first});
+    graph.run();
+    ASSERT_THROW(graph.wait(), std::runtime_error);
+    ASSERT_EQ(n_run.load(), 0);
+    pool.stop();
+}
+
+TEST_P(PoolTest, HighPriorityTasksJumpTheBacklog) {
+    Pool pool(1, GetParam());
+    pool.start();
+    Gate gate;
+    gate.hold(pool);
+    std::atomic<int> n_background(0);
+    std::atomic<int> background_before_high(-1);
+    for (int i = 0; i < 1000; ++i) 
+        pool.post(Options{Priority::Background}, [&n_background] (void) { ++n_background; });
+    pool.post(Options{Priority::High}, [&] (void) { background_before_high = n_background.load(); });
+    gate.open = true;
+    pool.stop(true);
+    // Background work gets a turn now and again, but not a thousand of them.
+    ASSERT_LE(background_before_high.load(), 1);
+    ASSERT_EQ(n_background.load(), 1000);
+}
+
+TEST_P(PoolTest, LanesShareTheWorkersByWeight) {
+    for (Weights weights : {Weights{0, 3, 1}, Weights{0, 0, 0}}) {
+        Pool pool(1, GetParam(), weights);
+        pool.start();
+        Gate gate;
+        gate.hold(pool);
+        // Only ever touched by the one worker.
+        std::vector<Priority> order;
+        for (int i = 0; i < 400; ++i) {
+            for (Priority priority : {Priority::Normal, Priority::Background}) 
+                pool.post(Options{priority}, [&order, priority] (void) { order.push_back(priority); });
+        }
+        gate.open = true;
+        pool.stop(true);
+        ASSERT_EQ(order.size(), 800u);
+        int n_normal = 0;
+        for (size_t i = 0; i < 100; ++i) 
+            n_normal += order[i] == Priority::Normal;
+        if (weights[2] == 0) 
+            ASSERT_EQ(n_normal, 100);
+        else {
+            ASSERT_GE(n_normal, 70);
+            ASSERT_LE(n_normal, 80);
+        }
+    }
+}
+
+TEST_P(PoolTest, LateTasksAreDroppedOrCounted) {
+    Pool pool(1, GetParam());
+    pool.start();
+    Gate gate;
+    gate.hold(pool);
+    auto soon = Clock::now() + std::chrono::milliseconds(10);
+    std::atomic<int> n_run(0);
+    auto dropped = pool.submit(Options{Priority::High, soon}, [] (void) { return 1; });
+    pool.post(Options{Priority::Normal, soon}, [&n_run] (void) { ++n_run; });
+    pool.post(Options{Priority::Background, soon, false}, [&n_run] (void) { n_run += 10; });
+    auto later = Clock::now() + std::chrono::hours(1);
+    auto on_time = pool.submit(Options{Priority::Normal, later}, [] (void) { return 2; });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    gate.open = true;
+    ASSERT_THROW(dropped.get(), DeadlineMissed);
+    ASSERT_EQ(on_time.get(), 2);
+    pool.stop(true);
+    // The one that wasn't to be dropped ran late, and the other didn't run at all.
+    ASSERT_EQ(n_run.load(), 10);
+    ASSERT_EQ(pool.late(), 3u);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Schedulings, 
+    PoolTest, 
+    testing::Values(Scheduling::Shared, Scheduling::Stealing)
+);
+
+}